@@ -0,0 +1,160 @@
+/*
+	cmapbash - a simple Minecraft map renderer written in C.
+	© 2014 saltire sable, x@saltiresable.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _POSIX_C_SOURCE 199309L // for clock_gettime
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blit.h"
+#include "image.h"
+#include "textures.h"
+
+
+#define BENCH_ROWS 65536
+#define BENCH_PASSES 64
+
+
+// a function that composites a row of sprite pixels under the image
+typedef uint8_t (*row_blitter)(uint8_t *dst, const palette *colours, const uint16_t codes);
+
+// a kind of row to time: sprite colours of one alpha drawn under image pixels of another
+typedef struct bench_case
+{
+	const char *name;     // description printed with the timings
+	uint8_t dst_alpha;    // alpha of the image pixels before drawing, or 0 for empty pixels
+	uint8_t sprite_alpha; // alpha of the sprite's colours
+}
+bench_case;
+
+
+// get the next value from a small linear congruential generator, so every run draws the same rows
+static uint32_t next_random(uint32_t *state)
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+
+// fill a premultiplied pixel with a random colour of the given alpha
+static void random_pixel(uint8_t *pixel, const uint8_t alpha, uint32_t *state)
+{
+	for (uint8_t c = 0; c < ALPHA; c++) pixel[c] = next_random(state);
+	pixel[ALPHA] = alpha;
+	premultiply_pixel(pixel);
+}
+
+
+// draw every row once, and return the bitmasks of opaque pixels combined
+static uint32_t blit_rows(row_blitter blit, uint8_t *image, const palette *colours,
+		const uint16_t *codes)
+{
+	uint32_t bits = 0;
+	for (uint32_t r = 0; r < BENCH_ROWS; r++)
+		bits += blit(&image[r * ISO_BLOCK_WIDTH * CHANNELS], colours, codes[r]);
+	return bits;
+}
+
+
+// time a blitter over the rows, starting from a fresh copy of the image each pass, and return
+// the mean time per row in nanoseconds
+static double time_blitter(row_blitter blit, uint8_t *image, const uint8_t *start,
+		const palette *colours, const uint16_t *codes, uint32_t *sink)
+{
+	const size_t size = BENCH_ROWS * ISO_BLOCK_WIDTH * CHANNELS;
+	double ns = 0;
+	for (uint16_t p = 0; p < BENCH_PASSES; p++)
+	{
+		memcpy(image, start, size);
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		*sink += blit_rows(blit, image, colours, codes);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns += (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	}
+	return ns / BENCH_PASSES / BENCH_ROWS;
+}
+
+
+int main(void)
+{
+	const bench_case cases[] = {
+		{"opaque sprites onto empty pixels", 0, 255},
+		{"translucent sprites onto translucent pixels", 128, 160},
+		{"opaque sprites onto opaque pixels", 255, 255},
+	};
+	const size_t size = BENCH_ROWS * ISO_BLOCK_WIDTH * CHANNELS;
+	uint8_t *start = (uint8_t*)malloc(size);
+	uint8_t *scalar = (uint8_t*)malloc(size);
+	uint8_t *vector = (uint8_t*)malloc(size);
+	uint16_t *codes = (uint16_t*)malloc(BENCH_ROWS * sizeof(uint16_t));
+	uint32_t sink = 0;
+	int status = 0;
+
+#ifndef __SSE2__
+	printf("Built without SSE2: both blitters use the scalar loop\n");
+#endif
+	printf("%d rows of %d sprite pixels, %d passes\n", BENCH_ROWS, ISO_BLOCK_WIDTH, BENCH_PASSES);
+
+	for (uint8_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		uint32_t state = i + 1;
+
+		// blank is always transparent, as it is in the shaded palettes
+		palette colours;
+		memset(colours[BLANK], 0, CHANNELS);
+		for (uint8_t c = COLOUR1; c < COLOUR_COUNT; c++)
+			random_pixel(colours[c], cases[i].sprite_alpha, &state);
+
+		for (uint32_t p = 0; p < BENCH_ROWS * ISO_BLOCK_WIDTH; p++)
+			random_pixel(&start[p * CHANNELS], cases[i].dst_alpha, &state);
+		for (uint32_t r = 0; r < BENCH_ROWS; r++)
+		{
+			codes[r] = 0;
+			for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
+				codes[r] |= next_random(&state) % COLOUR_COUNT << (sx * 4);
+		}
+
+		// both blitters must leave the same pixels and report the same opaque ones
+		memcpy(scalar, start, size);
+		memcpy(vector, start, size);
+		if (blit_rows(blit_iso_row_scalar, scalar, &colours, codes) !=
+				blit_rows(blit_iso_row, vector, &colours, codes) || memcmp(scalar, vector, size))
+		{
+			fprintf(stderr, "%s: blitters disagree\n", cases[i].name);
+			status = 1;
+		}
+
+		double sns = time_blitter(blit_iso_row_scalar, scalar, start, &colours, codes, &sink);
+		double vns = time_blitter(blit_iso_row, vector, start, &colours, codes, &sink);
+		printf("%-44s scalar %6.2f ns/row, vector %6.2f ns/row\n", cases[i].name, sns, vns);
+	}
+
+	// keep the results alive, so the drawing can't be optimised away
+	if (sink == 0) printf("\n");
+
+	free(start);
+	free(scalar);
+	free(vector);
+	free(codes);
+	return status;
+}
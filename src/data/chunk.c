@@ -23,6 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "nbt.h"
 
 #include "data.h"
@@ -69,24 +73,83 @@ uint16_t get_chunk_offset(const uint8_t rcx, const uint8_t rcz, const uint8_t ro
 }
 
 
-void get_neighbour_values(uint8_t nvalues[4], uint8_t *cdata, uint8_t *ncdata[4], uint8_t defval,
-		const uint8_t rbx, const uint8_t rbz, const uint8_t y, const uint8_t rotate)
+// get a column's padded index in rotated column order from its unrotated x/z coords,
+// which can be from -1 to CHUNK_BLOCK_LENGTH to include the halo
+static uint16_t get_rotated_column(const int8_t x, const int8_t z, const uint8_t rotate)
+{
+	switch(rotate) {
+	case 1:
+		return PADDED_COLUMN(MAX_CHUNK_BLOCK - z, x);
+	case 2:
+		return PADDED_COLUMN(MAX_CHUNK_BLOCK - x, MAX_CHUNK_BLOCK - z);
+	case 3:
+		return PADDED_COLUMN(z, MAX_CHUNK_BLOCK - x);
+	default:
+		return PADDED_COLUMN(x, z);
+	}
+}
+
+
+// rotate a chunk's YZX byte data into padded column order, replacing the original array
+static uint8_t *get_column_data(uint8_t *data, const uint8_t rotate, const uint8_t defval)
 {
-	nvalues[TOP] = rbz > 0 ? cdata[get_block_offset(rbx, rbz - 1, y, rotate)] :
-			(ncdata[TOP] == NULL ? defval :
-					ncdata[TOP][get_block_offset(rbx, MAX_CHUNK_BLOCK, y, rotate)]);
+	uint8_t *columns = (uint8_t*)malloc(PADDED_CHUNK_VOLUME);
+	memset(columns, defval, PADDED_CHUNK_VOLUME);
+
+	for (uint8_t z = 0; z < CHUNK_BLOCK_LENGTH; z++)
+	{
+		// find where each column in this row of the chunk will be stored
+		uint32_t co[CHUNK_BLOCK_LENGTH];
+		for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+			co[x] = get_rotated_column(x, z, rotate) * CHUNK_BLOCK_HEIGHT;
+
+		// transpose the row 16 blocks high at a time, turning 16 x rows into 16 y columns
+		for (uint16_t y = 0; y < CHUNK_BLOCK_HEIGHT; y += SECTION_BLOCK_HEIGHT)
+		{
+			const uint8_t *rows = &data[y * CHUNK_BLOCK_AREA + z * CHUNK_BLOCK_LENGTH];
+#ifdef __SSE2__
+			__m128i v[SECTION_BLOCK_HEIGHT], t[SECTION_BLOCK_HEIGHT];
+			for (uint8_t i = 0; i < SECTION_BLOCK_HEIGHT; i++)
+				v[i] = _mm_loadu_si128((const __m128i*)&rows[i * CHUNK_BLOCK_AREA]);
+
+			// four rounds of interleaving the top half of the rows with the bottom half
+			for (uint8_t round = 0; round < 4; round++)
+			{
+				for (uint8_t i = 0; i < SECTION_BLOCK_HEIGHT / 2; i++)
+				{
+					t[i * 2] = _mm_unpacklo_epi8(v[i], v[i + SECTION_BLOCK_HEIGHT / 2]);
+					t[i * 2 + 1] = _mm_unpackhi_epi8(v[i], v[i + SECTION_BLOCK_HEIGHT / 2]);
+				}
+				memcpy(v, t, sizeof(v));
+			}
+
+			for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+				_mm_storeu_si128((__m128i*)&columns[co[x] + y], v[x]);
+#else
+			for (uint8_t i = 0; i < SECTION_BLOCK_HEIGHT; i++)
+				for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+					columns[co[x] + y + i] = rows[i * CHUNK_BLOCK_AREA + x];
+#endif
+		}
+	}
 
-	nvalues[RIGHT] = rbx < MAX_CHUNK_BLOCK ? cdata[get_block_offset(rbx + 1, rbz, y, rotate)] :
-			(ncdata[RIGHT] == NULL ? defval :
-					ncdata[RIGHT][get_block_offset(0, rbz, y, rotate)]);
+	free(data);
+	return columns;
+}
 
-	nvalues[BOTTOM] = rbz < MAX_CHUNK_BLOCK ? cdata[get_block_offset(rbx, rbz + 1, y, rotate)] :
-			(ncdata[BOTTOM] == NULL ? defval :
-					ncdata[BOTTOM][get_block_offset(rbx, 0, y, rotate)]);
 
-	nvalues[LEFT] = rbx > 0 ? cdata[get_block_offset(rbx - 1, rbz, y, rotate)] :
-			(ncdata[LEFT] == NULL ? defval :
-					ncdata[LEFT][get_block_offset(MAX_CHUNK_BLOCK, rbz, y, rotate)]);
+// rotate padded column-order data a number of times 90 degrees clockwise, halo and all
+static uint8_t *rotate_column_data(const uint8_t *data, const uint8_t rotate,
+		const uint16_t height)
+{
+	if (data == NULL) return NULL;
+
+	uint8_t *columns = (uint8_t*)malloc(PADDED_CHUNK_AREA * height);
+	for (int8_t z = -1; z <= CHUNK_BLOCK_LENGTH; z++)
+		for (int8_t x = -1; x <= CHUNK_BLOCK_LENGTH; x++)
+			memcpy(&columns[get_rotated_column(x, z, rotate) * height],
+					&data[PADDED_COLUMN(x, z) * height], height);
+	return columns;
 }
 
 
@@ -200,8 +263,30 @@ static uint8_t *get_chunk_data(nbt_node *nbt, char *name, const bool half, const
 }
 
 
+// get a bit mask of the sections stored in a chunk's NBT node
+static uint16_t get_chunk_sections(nbt_node *nbt)
+{
+	uint16_t mask = 0;
+	nbt_node *sections = nbt_find_by_name(nbt, "Sections");
+	if (sections->type == TAG_LIST)
+	{
+		struct list_head *pos;
+		list_for_each(pos, &sections->payload.tag_list->entry)
+		{
+			struct nbt_list *section = list_entry(pos, struct nbt_list, entry);
+			if (section->data->type != TAG_COMPOUND) continue;
+			nbt_node *ynode = nbt_find_by_name(section->data, "Y");
+			if (ynode != NULL && ynode->type == TAG_BYTE && ynode->payload.tag_byte >= 0 &&
+					ynode->payload.tag_byte < CHUNK_SECTION_HEIGHT)
+				mask |= 1 << ynode->payload.tag_byte;
+		}
+	}
+	return mask;
+}
+
+
 chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const chunk_flags *flags,
-		uint8_t *cblimits, const uint8_t *ylimits)
+		uint8_t *cblimits, const uint8_t *ylimits, const uint8_t rotate)
 {
 	chunk_data *chunk = (chunk_data*)malloc(sizeof(chunk_data));
 	nbt_node *nbt = nbt_parse_compressed(cdata, length);
@@ -213,6 +298,7 @@ chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const c
 
 	// get chunk's block limits from the region if they exist
 	chunk->blimits = cblimits;
+	chunk->sections = get_chunk_sections(nbt);
 
 	// get chunk's byte data
 	chunk->bids = flags->bids ?
@@ -226,11 +312,29 @@ chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const c
 
 	if (flags->biomes)
 	{
-		chunk->biomes = (uint8_t*)malloc(CHUNK_BLOCK_AREA);
-		memcpy(chunk->biomes, nbt_find_by_name(nbt, "Biomes")->payload.tag_byte_array.data,
-				CHUNK_BLOCK_AREA);
+		chunk->biomes = (uint8_t*)malloc(flags->columns ? PADDED_CHUNK_AREA : CHUNK_BLOCK_AREA);
+		uint8_t *biomes = nbt_find_by_name(nbt, "Biomes")->payload.tag_byte_array.data;
+		if (flags->columns)
+		{
+			memset(chunk->biomes, 0, PADDED_CHUNK_AREA);
+			for (uint8_t z = 0; z < CHUNK_BLOCK_LENGTH; z++)
+				for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+					chunk->biomes[get_rotated_column(x, z, rotate)] =
+							biomes[z * CHUNK_BLOCK_LENGTH + x];
+		}
+		else
+			memcpy(chunk->biomes, biomes, CHUNK_BLOCK_AREA);
 	}
 	else chunk->biomes = NULL;
+	chunk->tints = NULL;
+
+	if (flags->columns)
+	{
+		if (chunk->bids != NULL) chunk->bids = get_column_data(chunk->bids, rotate, 0);
+		if (chunk->bdata != NULL) chunk->bdata = get_column_data(chunk->bdata, rotate, 0);
+		if (chunk->blight != NULL) chunk->blight = get_column_data(chunk->blight, rotate, 0);
+		if (chunk->slight != NULL) chunk->slight = get_column_data(chunk->slight, rotate, 255);
+	}
 
 	nbt_free(nbt);
 
@@ -238,6 +342,107 @@ chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const c
 }
 
 
+// copy one edge of a neighbouring chunk's data into the halo of a chunk stored in column order
+static void copy_halo_edge(uint8_t *data, const uint8_t *ndata, const uint8_t edge,
+		const uint16_t height)
+{
+	if (data == NULL || ndata == NULL) return;
+
+	switch(edge) {
+	case TOP:
+		memcpy(&data[PADDED_COLUMN(0, -1) * height],
+				&ndata[PADDED_COLUMN(0, MAX_CHUNK_BLOCK) * height], CHUNK_BLOCK_LENGTH * height);
+		break;
+	case BOTTOM:
+		memcpy(&data[PADDED_COLUMN(0, CHUNK_BLOCK_LENGTH) * height],
+				&ndata[PADDED_COLUMN(0, 0) * height], CHUNK_BLOCK_LENGTH * height);
+		break;
+	case RIGHT:
+		for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz++)
+			memcpy(&data[PADDED_COLUMN(CHUNK_BLOCK_LENGTH, rbz) * height],
+					&ndata[PADDED_COLUMN(0, rbz) * height], height);
+		break;
+	case LEFT:
+		for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz++)
+			memcpy(&data[PADDED_COLUMN(-1, rbz) * height],
+					&ndata[PADDED_COLUMN(MAX_CHUNK_BLOCK, rbz) * height], height);
+		break;
+	}
+}
+
+
+void copy_chunk_halo(chunk_data *chunk, chunk_data *nchunks[4])
+{
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		if (nchunks[i] == NULL) continue;
+		copy_halo_edge(chunk->bids, nchunks[i]->bids, i, CHUNK_BLOCK_HEIGHT);
+		copy_halo_edge(chunk->bdata, nchunks[i]->bdata, i, CHUNK_BLOCK_HEIGHT);
+		copy_halo_edge(chunk->blight, nchunks[i]->blight, i, CHUNK_BLOCK_HEIGHT);
+		copy_halo_edge(chunk->slight, nchunks[i]->slight, i, CHUNK_BLOCK_HEIGHT);
+		copy_halo_edge(chunk->biomes, nchunks[i]->biomes, i, 1);
+	}
+}
+
+
+chunk_data *rotate_chunk(const chunk_data *chunk, const uint8_t rotate)
+{
+	chunk_data *rchunk = (chunk_data*)malloc(sizeof(chunk_data));
+	rchunk->blimits = chunk->blimits;
+	rchunk->sections = chunk->sections;
+	rchunk->bids   = rotate_column_data(chunk->bids,   rotate, CHUNK_BLOCK_HEIGHT);
+	rchunk->bdata  = rotate_column_data(chunk->bdata,  rotate, CHUNK_BLOCK_HEIGHT);
+	rchunk->blight = rotate_column_data(chunk->blight, rotate, CHUNK_BLOCK_HEIGHT);
+	rchunk->slight = rotate_column_data(chunk->slight, rotate, CHUNK_BLOCK_HEIGHT);
+	rchunk->biomes = rotate_column_data(chunk->biomes, rotate, 1);
+	rchunk->tints  = (uint16_t*)rotate_column_data((uint8_t*)chunk->tints, rotate, TINT_BYTES);
+	return rchunk;
+}
+
+
+// copy the part of each padded column within a range of heights, allocating the slice's array
+// filled with the default value the first time
+static uint8_t *copy_column_range(uint8_t *columns, const uint8_t *data, const uint8_t defval,
+		const uint8_t *ylimits)
+{
+	if (data == NULL) return columns;
+	if (columns == NULL)
+	{
+		columns = (uint8_t*)malloc(PADDED_CHUNK_VOLUME);
+		memset(columns, defval, PADDED_CHUNK_VOLUME);
+	}
+
+	// nothing is ever written outside the range, so it keeps the default value between chunks
+	for (uint16_t column = 0; column < PADDED_CHUNK_AREA; column++)
+		memcpy(&columns[column * CHUNK_BLOCK_HEIGHT + ylimits[0]],
+				&data[column * CHUNK_BLOCK_HEIGHT + ylimits[0]], ylimits[1] - ylimits[0] + 1);
+	return columns;
+}
+
+
+chunk_data *slice_chunk(chunk_data *slice, const chunk_data *chunk, const uint8_t *ylimits)
+{
+	if (slice == NULL) slice = (chunk_data*)calloc(1, sizeof(chunk_data));
+	slice->blimits  = chunk->blimits;
+	slice->sections = chunk->sections;
+	slice->bids   = copy_column_range(slice->bids,   chunk->bids,   0,   ylimits);
+	slice->bdata  = copy_column_range(slice->bdata,  chunk->bdata,  0,   ylimits);
+	slice->blight = copy_column_range(slice->blight, chunk->blight, 0,   ylimits);
+	slice->slight = copy_column_range(slice->slight, chunk->slight, 255, ylimits);
+	if (chunk->biomes != NULL)
+	{
+		if (slice->biomes == NULL) slice->biomes = (uint8_t*)malloc(PADDED_CHUNK_AREA);
+		memcpy(slice->biomes, chunk->biomes, PADDED_CHUNK_AREA);
+	}
+	if (chunk->tints != NULL)
+	{
+		if (slice->tints == NULL) slice->tints = (uint16_t*)malloc(PADDED_CHUNK_AREA * TINT_BYTES);
+		memcpy(slice->tints, chunk->tints, PADDED_CHUNK_AREA * TINT_BYTES);
+	}
+	return slice;
+}
+
+
 void free_chunk(chunk_data *chunk)
 {
 	if (chunk == NULL) return;
@@ -246,5 +451,6 @@ void free_chunk(chunk_data *chunk)
 	free(chunk->blight);
 	free(chunk->slight);
 	free(chunk->biomes);
+	free(chunk->tints);
 	free(chunk);
 }
@@ -55,6 +55,23 @@
 #define MAX_HEIGHT (CHUNK_BLOCK_HEIGHT - 1)
 
 
+// chunk data stored in rotated column order, padded with a halo of neighbouring columns
+
+#define PADDED_CHUNK_LENGTH (CHUNK_BLOCK_LENGTH + 2)
+#define PADDED_CHUNK_AREA (PADDED_CHUNK_LENGTH * PADDED_CHUNK_LENGTH)
+#define PADDED_CHUNK_VOLUME (PADDED_CHUNK_AREA * CHUNK_BLOCK_HEIGHT)
+
+#define COLUMN_X_STEP CHUNK_BLOCK_HEIGHT
+#define COLUMN_Z_STEP (PADDED_CHUNK_LENGTH * CHUNK_BLOCK_HEIGHT)
+
+// index of the column at rotated chunk-level x/z coords, from -1 to CHUNK_BLOCK_LENGTH
+#define PADDED_COLUMN(rbx, rbz) (((rbz) + 1) * PADDED_CHUNK_LENGTH + (rbx) + 1)
+
+// blended biome colour scales per column: foliage RGB, then grass RGB
+#define TINT_CHANNELS 6
+#define TINT_BYTES (TINT_CHANNELS * sizeof(uint16_t))
+
+
 // path lengths
 
 #define WORLDDIR_PATH_MAXLEN 255
@@ -100,14 +117,17 @@ typedef enum
 }
 iso_edges;
 
-// binary data for a chunk of blocks
+// binary data for a chunk of blocks, stored in the NBT's YZX order,
+// or if requested, rotated and stored in column (XZY) order with each column's blocks contiguous,
+// with an extra column on each side to hold a copy of the edge of each neighbouring chunk
 typedef struct chunk_data
 {
 	uint8_t *blimits; // pointer to an array of absolute min/max x/z block coords for this chunk
 	uint8_t *bids, *bdata, *blight, *slight, *biomes;
 	                  // pointers to byte data arrays for this chunk
-	uint8_t *nbids[4], *nbdata[4], *nblight[4], *nslight[4];
-	                  // arrays of pointers to byte data arrays for each rotated neighbouring chunk
+	uint16_t *tints;  // pointer to the scales, with 8 fractional bits, that turn the colours of
+	                  //   each column's own biome into the blended colours around it, or NULL
+	uint16_t sections; // bit mask of the sections stored in the chunk; the others are all air
 }
 chunk_data;
 
@@ -115,6 +135,7 @@ chunk_data;
 typedef struct chunk_flags
 {
 	bool bids, bdata, blight, slight, biomes; // whether to load each type of chunk data
+	bool columns; // whether to rotate the data and store it in column order
 }
 chunk_flags;
 
@@ -161,17 +182,25 @@ uint16_t get_block_offset(const uint8_t rbx, const uint8_t rbz, const uint8_t y,
  */
 uint16_t get_chunk_offset(const uint8_t rcx, const uint8_t rcz, const uint8_t rotate);
 
-/* get the data values for the 4 neighbouring blocks
- *   nvalues:  an output array of 4 data values
- *   cdata:    chunk data for the current chunk
- *   ncdata:   chunk data for the 4 neighbouring chunks, in case we're on an edge
- *   rbx, rbz: the block's rotated chunk-level x/z coords
- *   y:        the block's y coord
- *   rotate:   the rotate value
- *   defval:   a default value for nonexistent blocks
+/* get the data values for the 4 neighbouring blocks, from chunk data stored in column order
+ *   nvalues: an output array of 4 data values
+ *   cdata:   chunk data for the current chunk
+ *   offset:  the block's offset in the chunk data
  */
-void get_neighbour_values(uint8_t nvalues[4], uint8_t *cdata, uint8_t *ncdata[4], uint8_t defval,
-		const uint8_t rbx, const uint8_t rbz, const uint8_t y, const uint8_t rotate);
+static inline void get_neighbour_values(uint8_t nvalues[4], const uint8_t *cdata,
+		const uint32_t offset)
+{
+	nvalues[TOP]    = cdata[offset - COLUMN_Z_STEP];
+	nvalues[RIGHT]  = cdata[offset + COLUMN_X_STEP];
+	nvalues[BOTTOM] = cdata[offset + COLUMN_Z_STEP];
+	nvalues[LEFT]   = cdata[offset - COLUMN_X_STEP];
+}
+
+/* copy the edges of the neighbouring chunks into the halo of a chunk stored in column order
+ *   chunk:   pointer to the chunk data struct
+ *   nchunks: array of pointers to the 4 rotated neighbouring chunks, or NULL where absent
+ */
+void copy_chunk_halo(chunk_data *chunk, chunk_data *nchunks[4]);
 
 /* generate a chunk data struct from raw chunk data in the region file
  *   cdata:    pointer to the binary data
@@ -179,9 +208,10 @@ void get_neighbour_values(uint8_t nvalues[4], uint8_t *cdata, uint8_t *ncdata[4]
  *   flags:    pointer to a struct indicating which byte arrays to read from the NBT node
  *   cblimits: pointer to an array of absolute min/max x/z block coords for this chunk
  *   ylimits:  pointer to an array of min/max y coords
+ *   rotate:   the rotate value, if storing the data in column order
  */
 chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const chunk_flags *flags,
-		uint8_t *cblimits, const uint8_t *ylimits);
+		uint8_t *cblimits, const uint8_t *ylimits, const uint8_t rotate);
 
 /* locate and read raw chunk data from the region file and return a chunk data struct
  *   reg:      pointer to the region struct
@@ -193,6 +223,21 @@ chunk_data *parse_chunk_nbt(const uint8_t *cdata, const uint32_t length, const c
 chunk_data *read_chunk(const region *reg, const uint8_t rcx, const uint8_t rcz,
 		const uint8_t rotate, const chunk_flags *flags, const uint8_t *ylimits);
 
+/* copy a chunk stored in column order, rotated a further number of times 90 degrees clockwise
+ *   chunk:  pointer to the chunk data struct, with its halo already copied from its neighbours
+ *   rotate: the number of times to rotate the copy
+ */
+chunk_data *rotate_chunk(const chunk_data *chunk, const uint8_t rotate);
+
+/* copy the blocks of a chunk stored in column order that lie within a range of heights,
+ * leaving the rest empty, as if the chunk had been read with those y limits
+ *   slice:   pointer to a slice returned by an earlier call for a chunk with the same types of
+ *            data, whose arrays are reused, or NULL to allocate a new one
+ *   chunk:   pointer to the chunk data struct, read with y limits containing the range
+ *   ylimits: pointer to an array of min/max y coords
+ */
+chunk_data *slice_chunk(chunk_data *slice, const chunk_data *chunk, const uint8_t *ylimits);
+
 /* free the memory used for a chunk data struct
  *   chunk: pointer to the chunk data struct
  */
@@ -228,6 +273,14 @@ region *read_region(const char *regiondir, const int32_t rx, const int32_t rz,
  */
 void free_region(region *reg);
 
+/* rotate a pair of coords in a grid a number of times 90 degrees clockwise
+ *   x, z:         pointers to the x/z coords, which are replaced with the rotated coords
+ *   xsize, zsize: the width and height of the grid before rotating
+ *   rotate:       the number of times to rotate the coords
+ */
+void rotate_coords(uint32_t *x, uint32_t *z, const uint32_t xsize, const uint32_t zsize,
+		const uint8_t rotate);
+
 /* get a stored region struct from its rotated world-relative coords
  *   world:    pointer to the world struct
  *   rrx, rrz: the region's rotated world-relative x/z coords
@@ -50,7 +50,8 @@ chunk_data *read_chunk(const region *reg, const uint8_t rcx, const uint8_t rcz,
 	//printf("Reading %d bytes at %#lx.\n", length, ftell(rfile));
 	fread(cdata, length, 1, reg->file);
 
-	chunk_data *chunk = parse_chunk_nbt(cdata, length, flags, reg->cblimits[co], ylimits);
+	chunk_data *chunk = parse_chunk_nbt(cdata, length, flags, reg->cblimits[co], ylimits,
+			rotate);
 	free(cdata);
 
 	return chunk;
@@ -27,6 +27,27 @@
 #include "data.h"
 
 
+void rotate_coords(uint32_t *x, uint32_t *z, const uint32_t xsize, const uint32_t zsize,
+		const uint8_t rotate)
+{
+	uint32_t ox = *x, oz = *z;
+	switch(rotate % 4) {
+	case 1:
+		*x = zsize - 1 - oz;
+		*z = ox;
+		break;
+	case 2:
+		*x = xsize - 1 - ox;
+		*z = zsize - 1 - oz;
+		break;
+	case 3:
+		*x = oz;
+		*z = xsize - 1 - ox;
+		break;
+	}
+}
+
+
 region *get_region_from_coords(const worldinfo *world, const uint32_t rrx, const uint32_t rrz)
 {
 	// check if region is out of bounds
@@ -150,25 +171,9 @@ worldinfo *measure_world(char *worldpath, const uint8_t rotate, const int32_t *w
 			if (reg == NULL) continue;
 
 			// get rotated world-relative region coords from absolute coords
-			uint32_t rrx, rrz;
-			switch(world->rotate) {
-			case 0:
-				rrx = rx - rxmin;
-				rrz = rz - rzmin;
-				break;
-			case 1:
-				rrx = rzmax - rz;
-				rrz = rx - rxmin;
-				break;
-			case 2:
-				rrx = rxmax - rx;
-				rrz = rzmax - rz;
-				break;
-			case 3:
-				rrx = rz - rzmin;
-				rrz = rxmax - rx;
-				break;
-			}
+			uint32_t rrx = rx - rxmin;
+			uint32_t rrz = rz - rzmin;
+			rotate_coords(&rrx, &rrz, rxsize, rzsize, world->rotate);
 			world->regionmap[rrz * world->rrxsize + rrx] = reg;
 		}
 	closedir(dir);
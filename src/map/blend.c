@@ -0,0 +1,190 @@
+/*
+	cmapbash - a simple Minecraft map renderer written in C.
+	© 2014 saltire sable, x@saltiresable.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "data.h"
+#include "map.h"
+#include "textures.h"
+
+
+#define BLEND_WEIGHT 6
+#define BLEND_GRID_LENGTH (CHUNK_BLOCK_LENGTH + MAX_BLEND_RADIUS * 2)
+
+
+void get_blend_colours(blend_colour *colours, const textures *tex)
+{
+	memset(colours, 0, 256 * sizeof(blend_colour));
+	for (uint16_t id = 0; id < tex->biomecount; id++)
+	{
+		if (!tex->biomes[id].exists) continue;
+		for (uint8_t c = 0; c < 3; c++)
+		{
+			colours[id][c] = tex->biomes[id].foliage[c];
+			colours[id][c + 3] = tex->biomes[id].grass[c];
+		}
+		colours[id][BLEND_WEIGHT] = 1;
+	}
+}
+
+
+// get the biome ids of a row of columns reaching a radius outside a chunk on each side, from
+// whichever neighbour they fall in, or the nearest column of this chunk if there is no neighbour
+// there; diagonal neighbours aren't read, so the corners use this chunk's corner columns, which
+// gives the same blend in every rotation
+static void get_blend_row(uint8_t *ids, const chunk_data *chunk, chunk_data *nchunks[4],
+		const int8_t z, const uint8_t radius)
+{
+	const uint8_t length = CHUNK_BLOCK_LENGTH + radius * 2;
+	const int8_t cz = MIN(MAX(z, 0), MAX_CHUNK_BLOCK);
+	const uint8_t *own = &chunk->biomes[PADDED_COLUMN(0, cz)], *row = own;
+	const chunk_data *left = NULL, *right = NULL;
+	if (z < 0 && nchunks[TOP] != NULL && nchunks[TOP]->biomes != NULL)
+		row = &nchunks[TOP]->biomes[PADDED_COLUMN(0, z + CHUNK_BLOCK_LENGTH)];
+	else if (z > MAX_CHUNK_BLOCK && nchunks[BOTTOM] != NULL && nchunks[BOTTOM]->biomes != NULL)
+		row = &nchunks[BOTTOM]->biomes[PADDED_COLUMN(0, z - CHUNK_BLOCK_LENGTH)];
+	else if (z == cz)
+	{
+		if (nchunks[LEFT] != NULL && nchunks[LEFT]->biomes != NULL) left = nchunks[LEFT];
+		if (nchunks[RIGHT] != NULL && nchunks[RIGHT]->biomes != NULL) right = nchunks[RIGHT];
+	}
+
+	for (uint8_t x = 0; x < radius; x++)
+	{
+		ids[x] = left != NULL ?
+				left->biomes[PADDED_COLUMN(CHUNK_BLOCK_LENGTH - radius + x, z)] : own[0];
+		ids[length - radius + x] = right != NULL ?
+				right->biomes[PADDED_COLUMN(x, z)] : own[MAX_CHUNK_BLOCK];
+	}
+	memcpy(&ids[radius], row, CHUNK_BLOCK_LENGTH);
+}
+
+
+// sum a sliding window of cells along a line of the grid, for each of the chunk's columns
+static void sum_blend_window(blend_colour *out, const uint8_t ostride, blend_colour *in,
+		const uint8_t istride, const uint8_t diameter)
+{
+#ifdef __SSE2__
+	__m128i sum = _mm_setzero_si128();
+	for (uint8_t k = 0; k < diameter; k++)
+		sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i*)in[k * istride]));
+	_mm_storeu_si128((__m128i*)out[0], sum);
+
+	for (uint8_t i = 1; i < CHUNK_BLOCK_LENGTH; i++)
+	{
+		sum = _mm_sub_epi16(sum, _mm_loadu_si128((const __m128i*)in[(i - 1) * istride]));
+		sum = _mm_add_epi16(sum,
+				_mm_loadu_si128((const __m128i*)in[(i + diameter - 1) * istride]));
+		_mm_storeu_si128((__m128i*)out[i * ostride], sum);
+	}
+#else
+	blend_colour sum = {0};
+	for (uint8_t k = 0; k < diameter; k++)
+		for (uint8_t l = 0; l < BLEND_LANES; l++) sum[l] += in[k * istride][l];
+	memcpy(out[0], sum, sizeof(sum));
+
+	for (uint8_t i = 1; i < CHUNK_BLOCK_LENGTH; i++)
+	{
+		for (uint8_t l = 0; l < BLEND_LANES; l++)
+			sum[l] += in[(i + diameter - 1) * istride][l] - in[(i - 1) * istride][l];
+		memcpy(out[i * ostride], sum, sizeof(sum));
+	}
+#endif
+}
+
+
+// find the scales that turn a column's own biome colours into the average of its window, with
+// 8 fractional bits; channels of an unknown biome, or of a biome colour of zero, keep a scale of 1
+static inline void get_tint_scales(uint16_t *scales, const uint16_t *sum, const uint16_t *own)
+{
+#ifdef __SSE2__
+	// a window of one biome gives exact multiples of its colours, whose quotients are exact in
+	// single precision, so a uniform area keeps its colours exactly
+	__m128i zero = _mm_setzero_si128(), v = _mm_loadu_si128((const __m128i*)sum);
+	__m128i o = _mm_loadu_si128((const __m128i*)own);
+	__m128 w = _mm_set1_ps(sum[BLEND_WEIGHT]), f256 = _mm_set1_ps(256), half = _mm_set1_ps(0.5);
+	__m128i q[2];
+	for (uint8_t h = 0; h < 2; h++)
+	{
+		__m128 n = _mm_cvtepi32_ps(h ? _mm_unpackhi_epi16(v, zero) : _mm_unpacklo_epi16(v, zero));
+		__m128 d = _mm_mul_ps(w,
+				_mm_cvtepi32_ps(h ? _mm_unpackhi_epi16(o, zero) : _mm_unpacklo_epi16(o, zero)));
+		__m128 none = _mm_cmpeq_ps(d, _mm_setzero_ps());
+		__m128 r = _mm_add_ps(_mm_div_ps(_mm_mul_ps(n, f256), _mm_or_ps(d, _mm_and_ps(none, f256))),
+				half);
+		r = _mm_or_ps(_mm_andnot_ps(none, r), _mm_and_ps(none, f256));
+		// bias the scales, so that a signed pack can hold all 16 bits
+		q[h] = _mm_sub_epi32(_mm_cvttps_epi32(r), _mm_set1_epi32(0x8000));
+	}
+	uint16_t packed[BLEND_LANES];
+	_mm_storeu_si128((__m128i*)packed,
+			_mm_xor_si128(_mm_packs_epi32(q[0], q[1]), _mm_set1_epi16(0x8000)));
+	memcpy(scales, packed, TINT_BYTES);
+#else
+	for (uint8_t c = 0; c < TINT_CHANNELS; c++)
+	{
+		uint32_t d = sum[BLEND_WEIGHT] * own[c];
+		scales[c] = d ? ((sum[c] << 8) + d / 2) / d : 256;
+	}
+#endif
+}
+
+
+void blend_chunk_biomes(chunk_data *chunk, chunk_data *nchunks[4], const blend_colour *colours,
+		const uint8_t radius)
+{
+	if (chunk->biomes == NULL) return;
+	if (chunk->tints == NULL) chunk->tints = (uint16_t*)calloc(PADDED_CHUNK_AREA, TINT_BYTES);
+
+	// fill the grid with the colours of every column within the radius of the chunk
+	const uint8_t length = CHUNK_BLOCK_LENGTH + radius * 2, diameter = radius * 2 + 1;
+	blend_colour grid[BLEND_GRID_LENGTH * BLEND_GRID_LENGTH];
+	for (uint8_t gz = 0; gz < length; gz++)
+	{
+		uint8_t ids[BLEND_GRID_LENGTH];
+		get_blend_row(ids, chunk, nchunks, gz - radius, radius);
+		for (uint8_t gx = 0; gx < length; gx++)
+			memcpy(grid[gz * length + gx], colours[ids[gx]], sizeof(blend_colour));
+	}
+
+	// box filter the rows, then the columns of the result; the largest sum is the whole window
+	// of 255s, which fits in 16 bits up to the maximum radius
+	blend_colour rows[BLEND_GRID_LENGTH * CHUNK_BLOCK_LENGTH], sums[CHUNK_BLOCK_AREA];
+	for (uint8_t gz = 0; gz < length; gz++)
+		sum_blend_window(&rows[gz * CHUNK_BLOCK_LENGTH], 1, &grid[gz * length], 1, diameter);
+	for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+		sum_blend_window(&sums[x], CHUNK_BLOCK_LENGTH, &rows[x], CHUNK_BLOCK_LENGTH,
+				diameter);
+
+	// compare each column's window, averaged over the known biomes in it, with its own biome
+	for (uint8_t z = 0; z < CHUNK_BLOCK_LENGTH; z++)
+		for (uint8_t x = 0; x < CHUNK_BLOCK_LENGTH; x++)
+		{
+			uint16_t column = PADDED_COLUMN(x, z);
+			get_tint_scales(&chunk->tints[column * TINT_CHANNELS], sums[z * CHUNK_BLOCK_LENGTH + x],
+					colours[chunk->biomes[column]]);
+		}
+}
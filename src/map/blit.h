@@ -0,0 +1,97 @@
+/*
+	cmapbash - a simple Minecraft map renderer written in C.
+	© 2014 saltire sable, x@saltiresable.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLIT_H
+#define BLIT_H
+
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+#include "textures.h"
+
+
+/* composite a row of four sprite pixels under the pixels already in the image one pixel at a
+ * time, and return a bitmask of the ones that are now fully opaque
+ *   dst:     pointer to the first of the four image pixels
+ *   colours: premultiplied palette that the colour codes index
+ *   codes:   four 4-bit colour codes from a packed pixel map, first pixel lowest
+ */
+static inline uint8_t blit_iso_row_scalar(uint8_t *dst, const palette *colours,
+		const uint16_t codes)
+{
+	uint8_t bits = 0;
+	for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
+	{
+		uint8_t pcolour = codes >> (sx * 4) & 0xf;
+		if (pcolour != BLANK)
+			combine_alpha(&dst[sx * CHANNELS], (uint8_t*)(*colours)[pcolour], 0);
+		if (dst[sx * CHANNELS + ALPHA] == 255) bits |= 1 << sx;
+	}
+	return bits;
+}
+
+/* composite a row of four sprite pixels under the pixels already in the image, and return a
+ * bitmask of the ones that are now fully opaque; blank pixels have a transparent colour, so they
+ * leave the image unchanged, and the result matches blit_iso_row_scalar
+ *   dst:     pointer to the first of the four image pixels
+ *   colours: premultiplied palette that the colour codes index
+ *   codes:   four 4-bit colour codes from a packed pixel map, first pixel lowest
+ */
+static inline uint8_t blit_iso_row(uint8_t *dst, const palette *colours, const uint16_t codes)
+{
+#ifdef __SSE2__
+	uint32_t c[ISO_BLOCK_WIDTH];
+	for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
+		memcpy(&c[sx], (*colours)[codes >> (sx * 4) & 0xf], CHANNELS);
+
+	__m128i top = _mm_loadu_si128((const __m128i*)dst);
+	__m128i bottom = _mm_setr_epi32(c[0], c[1], c[2], c[3]);
+	__m128i zero = _mm_setzero_si128();
+	__m128i half[2];
+	for (uint8_t h = 0; h < 2; h++)
+	{
+		// widen two pixels to 16 bits per channel, and spread each top pixel's transparency
+		// across its channels
+		__m128i t16 = h ? _mm_unpackhi_epi8(top, zero) : _mm_unpacklo_epi8(top, zero);
+		__m128i b16 = h ? _mm_unpackhi_epi8(bottom, zero) : _mm_unpacklo_epi8(bottom, zero);
+		__m128i bmod = _mm_sub_epi16(_mm_set1_epi16(255),
+				_mm_shufflehi_epi16(_mm_shufflelo_epi16(t16, 0xff), 0xff));
+
+		// scale the bottom colour by it, rounding the same way as scale_channel
+		__m128i v = _mm_add_epi16(_mm_mullo_epi16(b16, bmod), _mm_set1_epi16(128));
+		half[h] = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+	}
+	__m128i result = _mm_add_epi8(top, _mm_packus_epi16(half[0], half[1]));
+
+	_mm_storeu_si128((__m128i*)dst, result);
+	return _mm_movemask_ps(_mm_castsi128_ps(
+			_mm_cmpeq_epi32(_mm_srli_epi32(result, 24), _mm_set1_epi32(255))));
+#else
+	return blit_iso_row_scalar(dst, colours, codes);
+#endif
+}
+
+
+#endif
@@ -22,239 +22,761 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blit.h"
 #include "data.h"
 #include "image.h"
 #include "map.h"
 #include "textures.h"
 
 
-// add a shadow to blocks below a certain height
-static inline void add_height_shading(unsigned char *pixel, const unsigned int y)
+// number of 64-bit words in a column's bit volume
+#define HEIGHT_WORDS (CHUNK_BLOCK_HEIGHT / 64)
+
+
+// lookup tables of shaded values for a colour channel, indexed by the channel's original value
+static uint8_t height_shades[CHUNK_BLOCK_HEIGHT][256]; // shadows for each block height
+static uint8_t light_shades[LIGHT_LEVELS][256];        // darkening for each sky/block light level
+static uint8_t contour_shades[2][256];                 // orthographic highlights and shadows
+
+// powers of the transparency of each alpha value, for compositing runs of translucent blocks
+static float alpha_powers[256][CHUNK_BLOCK_HEIGHT + 1];
+
+
+void init_shading_tables(void)
 {
-	if (pixel[ALPHA] == 0 || y >= HSHADE_BLOCK_HEIGHT) return;
-	adjust_colour_brightness(pixel, (((float)y / HSHADE_BLOCK_HEIGHT) - 1) * HSHADE_AMOUNT);
+	static bool initialized = 0;
+	if (initialized) return;
+
+	const float ambience = NIGHT_AMBIENCE;
+
+	for (uint16_t v = 0; v < 256; v++)
+	{
+		// an opaque grey pixel, so that every channel gets the same adjustment
+		uint8_t pixel[CHANNELS] = {v, v, v, 255};
+
+		// add a shadow to blocks below a certain height
+		for (uint16_t y = 0; y < CHUNK_BLOCK_HEIGHT; y++)
+		{
+			pixel[0] = v;
+			if (y < HSHADE_BLOCK_HEIGHT)
+				adjust_colour_brightness(pixel,
+						(((float)y / HSHADE_BLOCK_HEIGHT) - 1) * HSHADE_AMOUNT);
+			height_shades[y][v] = pixel[0];
+		}
+
+		// darken to ambient light only, then add brightness from another source
+		for (uint8_t l = 0; l < LIGHT_LEVELS; l++)
+		{
+			float brightness = (float)l / MAX_LIGHT;
+			uint8_t channel = v;
+			channel *= (ambience + (1 - ambience) * brightness);
+			light_shades[l][v] = channel;
+		}
+
+		pixel[0] = v;
+		adjust_colour_brightness(pixel, HILIGHT_AMOUNT);
+		contour_shades[0][v] = pixel[0];
+
+		pixel[0] = v;
+		adjust_colour_brightness(pixel, SHADOW_AMOUNT);
+		contour_shades[1][v] = pixel[0];
+
+		alpha_powers[v][0] = 1;
+		for (uint16_t n = 1; n <= CHUNK_BLOCK_HEIGHT; n++)
+			alpha_powers[v][n] = alpha_powers[v][n - 1] * (255 - v) / 255;
+	}
+
+	initialized = 1;
 }
 
 
-// adjust a colour's brightness based on ambient light + light from another source
-static void set_light_level(uint8_t *pixel, const float brightness, const float ambience)
+// replace each channel of a colour with its value in a lookup table
+static inline void shade_colour(uint8_t *pixel, const uint8_t shades[256])
 {
 	if (pixel[ALPHA] == 0) return;
 
 	for (uint8_t c = 0; c < ALPHA; c++)
-		// darken pixel to ambient light only, then add brightness
-		pixel[c] *= (ambience + (1 - ambience) * brightness);
+		pixel[c] = shades[pixel[c]];
 }
 
 
-// in isometric dark mode, adjust each face of the block to reflect sky/block light
-static void set_block_light_levels(palette *palette, const shape *bshape, const uint8_t tlight_i,
-		const uint8_t nlight[])
+// apply height shading to the colours in a bitmask, then adjust each face of the block to
+// reflect sky/block light, and premultiply the results ready to be composited
+static void shade_palette(palette *shaded, const palette *base, const uint8_t hcolours,
+		const uint8_t y, const uint8_t tlight, const uint8_t llight, const uint8_t rlight)
 {
-	if (tlight_i < MAX_LIGHT)
+	memcpy(shaded, base, sizeof(*shaded));
+
+	for (uint8_t c = 0; c < COLOUR_COUNT; c++)
+		if (hcolours & (1 << c)) shade_colour((*shaded)[c], height_shades[y]);
+
+	if (tlight < MAX_LIGHT)
+	{
+		shade_colour((*shaded)[COLOUR1], light_shades[tlight]);
+		shade_colour((*shaded)[COLOUR2], light_shades[tlight]);
+	}
+	if (llight < MAX_LIGHT)
 	{
-		float tlight = (float)tlight_i / MAX_LIGHT;
-		if (bshape->clrcount[COLOUR1])
-			set_light_level((*palette)[COLOUR1], tlight, NIGHT_AMBIENCE);
-		if (bshape->clrcount[COLOUR2])
-			set_light_level((*palette)[COLOUR2], tlight, NIGHT_AMBIENCE);
+		shade_colour((*shaded)[HILIGHT1], light_shades[llight]);
+		shade_colour((*shaded)[HILIGHT2], light_shades[llight]);
 	}
-	if (nlight[BOTTOM_LEFT] < MAX_LIGHT)
+	if (rlight < MAX_LIGHT)
 	{
-		float llight = (float)nlight[BOTTOM_LEFT] / MAX_LIGHT;
-		if (bshape->clrcount[HILIGHT1])
-			set_light_level((*palette)[HILIGHT1], llight, NIGHT_AMBIENCE);
-		if (bshape->clrcount[HILIGHT2])
-			set_light_level((*palette)[HILIGHT2], llight, NIGHT_AMBIENCE);
+		shade_colour((*shaded)[SHADOW1], light_shades[rlight]);
+		shade_colour((*shaded)[SHADOW2], light_shades[rlight]);
 	}
-	if (nlight[BOTTOM_RIGHT] < MAX_LIGHT)
+
+	for (uint8_t c = 0; c < COLOUR_COUNT; c++)
+		premultiply_pixel((*shaded)[c]);
+}
+
+
+// find the shaded palette for a block in the texture cache, shading and storing it if it isn't
+// there yet; slots are claimed with an atomic swap and published by storing the key last, so
+// threads can share the cache without locking, and entries are never evicted
+static const palette *get_shaded_palette(palette *scratch, const textures *tex,
+		const blocktype *btype, const int16_t biomeid, uint8_t hcolours, const uint8_t y,
+		const uint8_t tlight, const uint8_t llight, const uint8_t rlight)
+{
+	const palette *base = biomeid >= 0 ? &btype->biome_palettes[biomeid] : &btype->palette;
+
+	// all heights above the height shading limit, and all light levels at or above the maximum,
+	// produce the same colours, so they can share a key
+	uint8_t hy = y < HSHADE_BLOCK_HEIGHT ? y : MAX_HEIGHT;
+	uint8_t tl = tlight < MAX_LIGHT ? tlight : MAX_LIGHT;
+	uint8_t ll = llight < MAX_LIGHT ? llight : MAX_LIGHT;
+	uint8_t rl = rlight < MAX_LIGHT ? rlight : MAX_LIGHT;
+	if (hy == MAX_HEIGHT) hcolours = 0;
+
+	// pack the key, adding one so that zero can mark an empty slot
+	uint64_t key = ((uint64_t)btype->id << 4 | btype->subtype) << 9 | (biomeid + 1);
+	key = (((key << COLOUR_COUNT | hcolours) << 8 | hy) << 12 | tl << 8 | ll << 4 | rl) + 1;
+
+	if (tex->palette_cache != NULL)
 	{
-		float rlight = (float)nlight[BOTTOM_RIGHT] / MAX_LIGHT;
-		if (bshape->clrcount[SHADOW1])
-			set_light_level((*palette)[SHADOW1], rlight, NIGHT_AMBIENCE);
-		if (bshape->clrcount[SHADOW2])
-			set_light_level((*palette)[SHADOW2], rlight, NIGHT_AMBIENCE);
+		uint32_t hash = (key * 0x9e3779b97f4a7c15ULL) >> (64 - PALETTE_CACHE_BITS);
+		for (uint8_t i = 0; i < PALETTE_CACHE_PROBES; i++)
+		{
+			shaded_palette *entry = &tex->palette_cache[(hash + i) & (PALETTE_CACHE_SIZE - 1)];
+			uint64_t ekey = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+			if (ekey == key) return &entry->palette;
+
+			// claim an empty slot by marking it busy, so that no one reads it until it's filled
+			if (ekey == 0 && __atomic_compare_exchange_n(&entry->key, &ekey, UINT64_MAX, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				shade_palette(&entry->palette, base, hcolours, hy, tl, ll, rl);
+				__atomic_store_n(&entry->key, key, __ATOMIC_RELEASE);
+				return &entry->palette;
+			}
+		}
 	}
+
+	// the cache is full around this key, or another thread is filling the slot: shade a copy
+	shade_palette(scratch, base, hcolours, hy, tl, ll, rl);
+	return scratch;
 }
 
 
-static inline void replace_pixel(shape *bshape, const uint8_t so, const uint8_t colour)
+// scale a block's colour in its column's biome by the column's tint scales for the biome colour
+// it uses, to blend it with the biomes around the column; channels are limited to a maximum,
+// which for premultiplied colours is their alpha
+static inline void tint_biome_colour(uint8_t *colour, const chunk_data *chunk,
+		const uint16_t column, const uint8_t tint, const uint8_t max)
 {
-	bshape->clrcount[bshape->pixmap[so]] -= 1;
-	bshape->clrcount[colour] += 1;
-	bshape->pixmap[so] = colour;
+	if (tint == TINT_NONE) return;
+
+	const uint16_t *scales = &chunk->tints[column * TINT_CHANNELS + (tint - TINT_FOLIAGE) * 3];
+	for (uint8_t c = 0; c < ALPHA; c++)
+		colour[c] = MIN((uint32_t)max, (colour[c] * scales[c] + 128) >> 8);
 }
 
 
-static inline void replace_colour(shape *bshape, const uint8_t old, const uint8_t new)
+// check whether any of a column's tint scales would change its biome colours, which they only do
+// near the border of another biome
+static inline bool column_is_tinted(const chunk_data *chunk, const uint16_t column)
 {
-	for (uint8_t so = 0; so < ISO_BLOCK_AREA; so++)
-		if (bshape->pixmap[so] == old) bshape->pixmap[so] = new;
-	bshape->clrcount[new] += bshape->clrcount[old];
-	bshape->clrcount[old] = 0;
+	static const uint16_t identity[TINT_CHANNELS] = {256, 256, 256, 256, 256, 256};
+	return memcmp(&chunk->tints[column * TINT_CHANNELS], identity, TINT_BYTES) != 0;
 }
 
 
-void render_iso_column(image *img, const int32_t px, const int32_t py, const textures *tex,
-		chunk_data *chunk, const uint8_t rbx, const uint8_t rbz, const options *opts)
+// expand a mask with one bit per pixel into a mask with a nibble per pixel
+static inline uint64_t expand_pixel_mask(const uint16_t mask)
 {
-	// get unrotated chunk-level 2d block offset from rotated coordinates
-	uint8_t hoffset = get_block_offset(rbx, rbz, 0, opts->rotate);
+	static const uint16_t nibbles[16] =
+	{
+		0x0000, 0x000f, 0x00f0, 0x00ff, 0x0f00, 0x0f0f, 0x0ff0, 0x0fff,
+		0xf000, 0xf00f, 0xf0f0, 0xf0ff, 0xff00, 0xff0f, 0xfff0, 0xffff,
+	};
+	return (uint64_t)nibbles[mask & 0xf] | (uint64_t)nibbles[mask >> 4 & 0xf] << 16 |
+			(uint64_t)nibbles[mask >> 8 & 0xf] << 32 | (uint64_t)nibbles[mask >> 12] << 48;
+}
 
-	uint8_t biomeid = opts->biomes ? chunk->biomes[hoffset] : 0;
 
-	for (int16_t y = MAX_HEIGHT; y >= 0; y--)
+// get a bitmask of the colour codes used in a packed pixel map, not including blank
+static inline uint8_t get_pixmap_colours(const uint64_t pixmap)
+{
+	const uint64_t ones = 0x1111111111111111ULL, highs = 0x8888888888888888ULL;
+
+	uint8_t colours = 0;
+	for (uint8_t c = COLOUR1; c < COLOUR_COUNT; c++)
 	{
-		// get unrotated chunk-level 3d block offset
-		uint16_t offset = y * CHUNK_BLOCK_AREA + hoffset;
+		// the nibbles matching this colour become zero, which sets their high bits here
+		uint64_t x = pixmap ^ (ones * c);
+		if ((x - ones) & ~x & highs) colours |= 1 << c;
+	}
+	return colours;
+}
+
+
+// bit volumes marking blocks in each padded column of a chunk, one bit per y level
+typedef struct exposure
+{
+	uint64_t solid[PADDED_CHUNK_AREA][HEIGHT_WORDS];   // blocks whose shape has no blank pixels
+	uint64_t opaque[PADDED_CHUNK_AREA][HEIGHT_WORDS];  // solid blocks with no translucent colours
+	uint64_t exposed[PADDED_CHUNK_AREA][HEIGHT_WORDS]; // drawable blocks with a top or front face
+	                                                   //   not hidden behind an opaque block
+}
+exposure;
 
-		// skip air blocks or invalid block ids
-		if (chunk->bids[offset] == 0 || chunk->bids[offset] > tex->max_blockid) continue;
+
+// find the solid and opaque blocks in a column, and its drawable blocks if requested
+static inline void get_column_shape_flags(exposure *exp, const textures *tex,
+		const chunk_data *chunk, const uint16_t column, const uint8_t rotate,
+		const bool drawable)
+{
+	const uint8_t *bids = &chunk->bids[column * CHUNK_BLOCK_HEIGHT];
+	const uint8_t *bdata = &chunk->bdata[column * CHUNK_BLOCK_HEIGHT];
+
+	for (uint16_t y = 0; y < CHUNK_BLOCK_HEIGHT; y += 8)
+	{
+		// skip runs of air quickly
+		uint64_t run;
+		memcpy(&run, &bids[y], sizeof(run));
+		if (run == 0) continue;
+
+		for (uint16_t by = y; by < y + 8; by++)
+		{
+			if (bids[by] == 0 || bids[by] > tex->max_blockid) continue;
+
+			uint64_t bit = 1ULL << (by & 63);
+			uint8_t flags = get_block_material(tex, bids[by], bdata[by])->shape_flags;
+			if (flags & SOLID_SHAPE(rotate)) exp->solid[column][by >> 6] |= bit;
+			if (flags & OPAQUE_SHAPE(rotate)) exp->opaque[column][by >> 6] |= bit;
+			if (drawable) exp->exposed[column][by >> 6] |= bit;
+		}
+	}
+}
+
+
+// mark the blocks in a chunk that could be visible: those that aren't covered by an opaque
+// block above them and opaque blocks in both neighbouring columns in front of them
+static void get_exposed_blocks(exposure *exp, const textures *tex, const chunk_data *chunk,
+		const uint8_t rotate)
+{
+	memset(exp, 0, sizeof(*exp));
+
+	// the front neighbours of the chunk's last row and column are in the halo
+	for (uint8_t rbz = 0; rbz <= CHUNK_BLOCK_LENGTH; rbz++)
+		for (uint8_t rbx = 0; rbx <= CHUNK_BLOCK_LENGTH; rbx++)
+			if (rbx < CHUNK_BLOCK_LENGTH || rbz < CHUNK_BLOCK_LENGTH)
+				get_column_shape_flags(exp, tex, chunk, PADDED_COLUMN(rbx, rbz), rotate,
+						rbx < CHUNK_BLOCK_LENGTH && rbz < CHUNK_BLOCK_LENGTH);
+
+	for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz++)
+		for (uint8_t rbx = 0; rbx < CHUNK_BLOCK_LENGTH; rbx++)
+		{
+			uint16_t column = PADDED_COLUMN(rbx, rbz);
+			const uint64_t *opaque = exp->opaque[column];
+			const uint64_t *lopaque = exp->opaque[column + PADDED_CHUNK_LENGTH];
+			const uint64_t *ropaque = exp->opaque[column + 1];
+
+			for (uint8_t w = 0; w < HEIGHT_WORDS; w++)
+			{
+				// shift the column down one level, so each bit marks the block above
+				uint64_t above = opaque[w] >> 1 | (w < HEIGHT_WORDS - 1 ? opaque[w + 1] << 63 : 0);
+				exp->exposed[column][w] &= ~(above & lopaque[w] & ropaque[w]);
+			}
+		}
+}
+
+
+// remove the highest block from a column's bit volume and return its y level, or -1 if none
+static inline int16_t pop_highest_block(uint64_t blocks[HEIGHT_WORDS])
+{
+	for (int8_t w = HEIGHT_WORDS - 1; w >= 0; w--)
+		if (blocks[w])
+		{
+			int16_t y = w * 64 + 63 - __builtin_clzll(blocks[w]);
+			blocks[w] &= ~(1ULL << (y & 63));
+			return y;
+		}
+	return -1;
+}
+
+
+// render a single column of blocks to an isometric map
+static inline __attribute__((always_inline)) void render_iso_column(image *img,
+		coverage *cov, const int32_t px, const int32_t py, const textures *tex,
+		chunk_data *chunk, const exposure *exp, const uint16_t column, const options *opts,
+		const uint8_t rotate)
+{
+	uint8_t biomeid = opts->biomes ? chunk->biomes[column] : 0;
+	bool tinted = opts->biomes && chunk->tints != NULL && column_is_tinted(chunk, column);
+
+	// walk down through the exposed blocks only
+	uint64_t blocks[HEIGHT_WORDS];
+	memcpy(blocks, exp->exposed[column], sizeof(blocks));
+	int16_t section = -1;
+
+	for (int16_t y = pop_highest_block(blocks); y >= 0; y = pop_highest_block(blocks))
+	{
+		// on reaching each section, skip the whole section if it would be hidden
+		if (cov != NULL && y / SECTION_BLOCK_HEIGHT != section)
+		{
+			section = y / SECTION_BLOCK_HEIGHT;
+			int16_t stop = (section + 1) * SECTION_BLOCK_HEIGHT - 1;
+			if (pixels_covered(cov, px, py + (MAX_HEIGHT - stop) * ISO_BLOCK_DEPTH,
+					(SECTION_BLOCK_HEIGHT - 1) * ISO_BLOCK_DEPTH + ISO_BLOCK_HEIGHT))
+			{
+				blocks[y >> 6] &= ~(((1ULL << SECTION_BLOCK_HEIGHT) - 1)
+						<< (y & 63 & ~(SECTION_BLOCK_HEIGHT - 1)));
+				continue;
+			}
+		}
+
+		// get chunk-level 3d block offset
+		uint32_t offset = column * CHUNK_BLOCK_HEIGHT + y;
 
 		// get block's pixel y coord
 		uint32_t bpy = py + (MAX_HEIGHT - y) * ISO_BLOCK_DEPTH;
 
 		// find which pixels are obscured, and skip this block if they all are
 		uint16_t mask = 0;
-		for (uint8_t sy = 0; sy < ISO_BLOCK_HEIGHT; sy++)
-			for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
-			{
-				uint8_t so = sy * ISO_BLOCK_WIDTH + sx;
-				uint8_t alpha = img->data[((bpy + sy) * img->width + px + sx) * CHANNELS + ALPHA];
-				// flip the bit for this pixel if it is already fully opaque in the image
-				if (alpha == 255) mask |= 1 << so;
-			}
+		if (cov != NULL)
+			// read each row's bits straight from the coverage bitmap
+			for (uint8_t sy = 0; sy < ISO_BLOCK_HEIGHT; sy++)
+				mask |= get_opaque_pixels(cov, px, bpy + sy) << (sy * ISO_BLOCK_WIDTH);
+		else
+			for (uint8_t sy = 0; sy < ISO_BLOCK_HEIGHT; sy++)
+				for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
+				{
+					uint8_t so = sy * ISO_BLOCK_WIDTH + sx;
+					uint8_t alpha =
+							img->data[((bpy + sy) * img->width + px + sx) * CHANNELS + ALPHA];
+					// flip the bit for this pixel if it is already fully opaque in the image
+					if (alpha == 255) mask |= 1 << so;
+				}
 		if (mask == 0xffff) continue;
 
-		// get neighbour block ids and data values
-		uint8_t nbids[4], nbdata[4];
-		get_neighbour_values(nbids, chunk->bids, chunk->nbids, 0, rbx, rbz, y, opts->rotate);
-		get_neighbour_values(nbdata, chunk->bdata, chunk->nbdata, 0, rbx, rbz, y, opts->rotate);
-
-		// get the type of this block and overlapping blocks
-		const blocktype *btype = get_block_type(tex, chunk->bids[offset], chunk->bdata[offset]);
-		const blocktype *tbtype = y == MAX_HEIGHT ? NULL : get_block_type(tex,
-				chunk->bids[offset + CHUNK_BLOCK_AREA], chunk->bdata[offset + CHUNK_BLOCK_AREA]);
-		const blocktype *lbtype = get_block_type(tex, nbids[BOTTOM_LEFT], nbdata[BOTTOM_LEFT]);
-		const blocktype *rbtype = get_block_type(tex, nbids[BOTTOM_RIGHT], nbdata[BOTTOM_RIGHT]);
-
-		// get block shape for this rotation
-		shape bshape = btype->shapes[opts->rotate];
+		// get the materials of this block and the block above
+		const material *mat = get_block_material(tex, chunk->bids[offset], chunk->bdata[offset]);
+		const material *tmat = y == MAX_HEIGHT || chunk->bids[offset + 1] > tex->max_blockid ?
+				NULL : get_block_material(tex, chunk->bids[offset + 1], chunk->bdata[offset + 1]);
+		const blocktype *btype = get_material_type(tex, mat);
 
 		// don't draw the top layer if the block above is the same type as this one, and is solid
 		// otherwise stripes will appear in columns of translucent blocks
-		if (tbtype != NULL && tbtype->id == btype->id && bshape.clrcount[BLANK] == 0)
+		if (tmat != NULL && tmat->id == mat->id && mat->shape_flags & SOLID_SHAPE(rotate))
 			mask |= (1 << ISO_BLOCK_WIDTH * ISO_BLOCK_TOP_HEIGHT) - 1;
+		uint64_t visible = ~expand_pixel_mask(mask);
 
-		// replace each masked pixel's colour with blank - may save time later
-		for (uint8_t so = 0; so < ISO_BLOCK_AREA; so++)
-			if ((mask & (1 << so)) && bshape.pixmap[so] != BLANK) replace_pixel(&bshape, so, BLANK);
+		// only colours still visible at this point are shaded for height
+		uint8_t hcolours = get_pixmap_colours(btype->pixmaps[rotate][0] & visible);
 
-		// get block colour palette, using biome colours if applicable
-		palette palette;
-		if (opts->biomes && btype->biome_palettes != NULL)
-			memcpy(&palette, &btype->biome_palettes[biomeid], sizeof(palette));
-		else
-			memcpy(&palette, &btype->palette, sizeof(palette));
-
-		// adjust colours for height
-		for (uint8_t c = 0; c < COLOUR_COUNT; c++)
-			if (bshape.clrcount[c]) add_height_shading(palette[c], y);
+		// use the shape with highlight and/or shadow replaced by unshaded colour if that side is
+		// blocked, and blank out the masked pixels
+		uint64_t bit = 1ULL << (y & 63);
+		uint8_t blocked = (exp->solid[column + PADDED_CHUNK_LENGTH][y >> 6] & bit ?
+				HILIGHT_BLOCKED : 0) | (exp->solid[column + 1][y >> 6] & bit ? SHADOW_BLOCKED : 0);
+		uint64_t pixmap = btype->pixmaps[rotate][blocked] & visible;
 
-		// replace highlight and/or shadow with unshaded colour if that side is blocked
-		if (lbtype->shapes[opts->rotate].clrcount[BLANK] == 0)
+		// get light levels from sky light (day + shadows) or block light (dark)
+		uint8_t tlight = MAX_LIGHT, nlight[4] = {MAX_LIGHT, MAX_LIGHT, MAX_LIGHT, MAX_LIGHT};
+		if (opts->shadows)
 		{
-			if (bshape.clrcount[HILIGHT1]) replace_colour(&bshape, HILIGHT1, COLOUR1);
-			if (bshape.clrcount[HILIGHT2]) replace_colour(&bshape, HILIGHT2, COLOUR2);
+			tlight = y == MAX_HEIGHT ? 255 : chunk->slight[offset + 1];
+			get_neighbour_values(nlight, chunk->slight, offset);
 		}
-		if (rbtype->shapes[opts->rotate].clrcount[BLANK] == 0)
+		else if (opts->dark)
 		{
-			if (bshape.clrcount[SHADOW1]) replace_colour(&bshape, SHADOW1, COLOUR1);
-			if (bshape.clrcount[SHADOW2]) replace_colour(&bshape, SHADOW2, COLOUR2);
+			tlight = y == MAX_HEIGHT ? 0 : chunk->blight[offset + 1];
+			get_neighbour_values(nlight, chunk->blight, offset);
 		}
 
-		// darken colours according to sky light (day + shadows) or block light (dark)
-		if (opts->shadows || opts->dark)
+		// get block colour palette, using biome colours if applicable, shaded for height and light
+		int16_t biome = opts->biomes && mat->biome_row >= 0 ? biomeid : -1;
+		palette scratch;
+		const palette *palette = get_shaded_palette(&scratch, tex, btype, biome, hcolours, y,
+				tlight, nlight[BOTTOM_LEFT], nlight[BOTTOM_RIGHT]);
+
+		// blend biome colours with the surrounding columns' after shading, so that the cached
+		// palettes stay shared by every column of the biome; only the colours the block draws,
+		// and the blank colour, are copied for tinting
+		if (tinted && biome >= 0)
 		{
-			uint8_t tlight, nlight[4];
-			uint32_t toffset = offset + CHUNK_BLOCK_AREA;
-			if (opts->shadows)
-			{
-				tlight = toffset > CHUNK_BLOCK_VOLUME ? 255 : chunk->slight[toffset];
-				get_neighbour_values(nlight, chunk->slight, chunk->nslight, 255,
-						rbx, rbz, y, opts->rotate);
-			}
-			else if (opts->dark)
-			{
-				tlight = toffset > CHUNK_BLOCK_VOLUME ? 0 : chunk->blight[toffset];
-				get_neighbour_values(nlight, chunk->blight, chunk->nblight, 0,
-						rbx, rbz, y, opts->rotate);
-			}
-			set_block_light_levels(&palette, &bshape, tlight, nlight);
+			uint8_t used = get_pixmap_colours(pixmap);
+			if (palette != &scratch)
+				for (uint8_t c = BLANK; c < COLOUR_COUNT; c++)
+					if (c == BLANK || used & 1 << c) memcpy(scratch[c], (*palette)[c], CHANNELS);
+			for (uint8_t c = COLOUR1; c < COLOUR_COUNT; c++)
+				if (used & 1 << c)
+					tint_biome_colour(scratch[c], chunk, column, btype->tints[c >= COLOUR2],
+							scratch[c][ALPHA]);
+			palette = &scratch;
 		}
 
-		// draw pixels
+		// draw pixels a row at a time
 		for (uint8_t sy = 0; sy < ISO_BLOCK_HEIGHT; sy++)
-			for (uint8_t sx = 0; sx < ISO_BLOCK_WIDTH; sx++)
-			{
-				uint8_t so = sy * ISO_BLOCK_WIDTH + sx;
-				uint8_t pcolour = bshape.pixmap[so];
-				if (pcolour == BLANK) continue;
-				{
-					uint32_t po = (bpy + sy) * img->width + px + sx;
-					combine_alpha(&img->data[po * CHANNELS], palette[pcolour], 0);
-				}
-			}
+		{
+			uint16_t codes = pixmap >> (sy * ISO_BLOCK_WIDTH * 4);
+			if (codes == 0) continue;
+
+			uint8_t bits = blit_iso_row(&img->data[((bpy + sy) * img->width + px) * CHANNELS],
+					palette, codes);
+			if (cov != NULL) set_opaque_pixels(cov, px, bpy + sy, bits);
+		}
+	}
+}
+
+
+// get the contour shading of an orthographic block: a highlight (0) if there is air above or to
+// the left of it, a shadow (1) if there is air below or to the right, or neither (-1)
+static inline int8_t get_ortho_contour(const chunk_data *chunk, const uint32_t offset)
+{
+	uint8_t nbids[4];
+	get_neighbour_values(nbids, chunk->bids, offset);
+	bool light = (nbids[TOP] == 0 || nbids[LEFT] == 0);
+	bool dark = (nbids[BOTTOM] == 0 || nbids[RIGHT] == 0);
+	return light == dark ? -1 : dark;
+}
+
+
+// get the block light that shades the top of an orthographic block, or MAX_LIGHT to leave it
+// unshaded; a block at the top of the world has no block above it to hold light, so in dark
+// mode it is fully darkened
+static inline uint8_t get_ortho_light(const chunk_data *chunk, const uint32_t offset,
+		const int16_t y, const bool dark)
+{
+	if (!dark) return MAX_LIGHT;
+	return y < MAX_HEIGHT ? chunk->blight[offset + 1] : 0;
+}
+
+
+// shade the colour of an orthographic block for its height, unless y is -1 because that has
+// already been done, then for its contour and light
+static inline void shade_ortho_colour(uint8_t *colour, const int16_t y, const int8_t contour,
+		const uint8_t tbl)
+{
+	if (y >= 0) shade_colour(colour, height_shades[y]);
+	if (contour >= 0) shade_colour(colour, contour_shades[contour]);
+	if (tbl < MAX_LIGHT) shade_colour(colour, light_shades[tbl]);
+}
+
+
+// count the layers in a run of identical translucent blocks starting at this one, that get the
+// same contour and light shading, and are all on the same side of the height shading limit
+static inline uint16_t get_translucent_run(const chunk_data *chunk, const uint32_t offset,
+		const int16_t y, const int8_t contour, const uint8_t tbl, const options *opts)
+{
+	uint16_t run = 1;
+	for (int16_t ry = y - 1; ry >= 0; ry--, run++)
+	{
+		uint32_t roffset = offset - run;
+		if (chunk->bids[roffset] != chunk->bids[offset] ||
+				chunk->bdata[roffset] != chunk->bdata[offset] ||
+				(ry < HSHADE_BLOCK_HEIGHT) != (y < HSHADE_BLOCK_HEIGHT) ||
+				get_ortho_contour(chunk, roffset) != contour ||
+				(opts->dark && chunk->blight[roffset + 1] != tbl))
+			break;
 	}
+	return run;
 }
 
 
-void render_ortho_column(image *img, const int32_t px, const int32_t py, const textures *tex,
-		chunk_data *chunk, const uint32_t rbx, const uint32_t rbz, const options *opts)
+// turn a colour into the combined colour of a run of translucent layers of it, each shaded for
+// its own height; each layer shows through the ones above it in proportion to a power of the
+// colour's transparency, and height shading darkens linearly with depth, so the run looks like
+// a single layer shaded at the weighted mean of its heights
+static inline void shade_translucent_run(uint8_t *colour, const int16_t y, const uint16_t run)
+{
+	float a = (float)colour[ALPHA] / 255;
+	float tn = alpha_powers[colour[ALPHA]][run];
+	float coverage = 1 - tn;
+
+	if (y < HSHADE_BLOCK_HEIGHT)
+	{
+		// sum of each layer's depth below the top, weighted by how much of it shows through
+		float depth = (1 - a) * (1 - run * alpha_powers[colour[ALPHA]][run - 1] +
+				(run - 1) * tn) / a;
+		adjust_colour_brightness(colour,
+				(((y - depth / coverage) / HSHADE_BLOCK_HEIGHT) - 1) * HSHADE_AMOUNT);
+	}
+	colour[ALPHA] = coverage * 255 + 0.5;
+}
+
+
+// render a single column of blocks to an orthographic map
+static inline __attribute__((always_inline)) void render_ortho_column(image *img,
+		const int32_t px, const int32_t py, const textures *tex, chunk_data *chunk,
+		const uint16_t column, const options *opts)
 {
 	// get pixel buffer for this block's rotated position
 	uint8_t *pixel = &img->data[(py * img->width + px) * CHANNELS];
 
-	// get unrotated 2d block offset from rotated coordinates
-	uint16_t hoffset = get_block_offset(rbx, rbz, 0, opts->rotate);
-
-	uint8_t biomeid = opts->biomes ? chunk->biomes[hoffset] : 0;
+	uint8_t biomeid = opts->biomes ? chunk->biomes[column] : 0;
+	bool tinted = opts->biomes && chunk->tints != NULL && column_is_tinted(chunk, column);
 
 	for (int16_t y = MAX_HEIGHT; y >= 0 && pixel[ALPHA] < 255; y--)
 	{
-		// get unrotated 3d block offset
-		uint16_t offset = y * CHUNK_BLOCK_AREA + hoffset;
+		// get chunk-level 3d block offset
+		uint32_t offset = column * CHUNK_BLOCK_HEIGHT + y;
 
 		// skip air blocks or invalid block ids
 		if (chunk->bids[offset] == 0 || chunk->bids[offset] >= tex->max_blockid) continue;
 
-		// get the type of this block
-		const blocktype *btype = get_block_type(tex, chunk->bids[offset], chunk->bdata[offset]);
-
 		// copy the block colour, using biomes if applicable
 		uint8_t colour[CHANNELS];
-		if (opts->biomes && btype->biome_palettes != NULL)
-			memcpy(colour, btype->biome_palettes[biomeid][COLOUR1], CHANNELS);
-		else
-			memcpy(colour, btype->palette[COLOUR1], CHANNELS);
-
-		// adjust colour for height
-		add_height_shading(colour, y);
-
-		// contour highlights and shadows
-		uint8_t nbids[4];
-		get_neighbour_values(nbids, chunk->bids, chunk->nbids, 0, rbx, rbz, y, opts->rotate);
-		bool light = (nbids[TOP] == 0 || nbids[LEFT] == 0);
-		bool dark = (nbids[BOTTOM] == 0 || nbids[RIGHT] == 0);
-		if (light && !dark) adjust_colour_brightness(colour, HILIGHT_AMOUNT);
-		if (dark && !light) adjust_colour_brightness(colour, SHADOW_AMOUNT);
-
-		// dark mode: darken colours according to block light
-		if (opts->dark) {
-			float tbl = y < MAX_HEIGHT ? chunk->blight[offset + CHUNK_BLOCK_AREA] : 0;
-			if (tbl < MAX_LIGHT) set_light_level(colour, tbl / MAX_LIGHT, NIGHT_AMBIENCE);
+		memcpy(colour, get_block_colour(tex, chunk->bids[offset], chunk->bdata[offset],
+				opts->biomes, biomeid), CHANNELS);
+		if (tinted)
+			tint_biome_colour(colour, chunk, column,
+					get_block_material(tex, chunk->bids[offset], chunk->bdata[offset])->tint, 255);
+
+		int8_t contour = get_ortho_contour(chunk, offset);
+		uint8_t tbl = get_ortho_light(chunk, offset, y, opts->dark);
+
+		// composite a run of the same translucent block in one step, and skip past it
+		uint16_t run = colour[ALPHA] < 255 && colour[ALPHA] > 0 ?
+				get_translucent_run(chunk, offset, y, contour, tbl, opts) : 1;
+		if (run > 1)
+		{
+			shade_translucent_run(colour, y, run);
+			y -= run - 1;
+			shade_ortho_colour(colour, -1, contour, tbl);
 		}
+		else
+			shade_ortho_colour(colour, y, contour, tbl);
 
+		premultiply_pixel(colour);
 		combine_alpha(pixel, colour, 0);
 	}
 }
+
+
+// find the height of the highest block in a column that the orthographic walker would draw, or -1
+static inline int16_t find_top_block(const textures *tex, const uint8_t *bids)
+{
+#ifdef __SSE2__
+	// ids from 1 to below the maximum are drawn, so subtracting one puts them all in a range
+	if (tex->max_blockid < 2) return -1;
+	__m128i one = _mm_set1_epi8(1), limit = _mm_set1_epi8(tex->max_blockid - 2);
+	for (int8_t k = CHUNK_BLOCK_HEIGHT / 16 - 1; k >= 0; k--)
+	{
+		__m128i ids = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)&bids[k * 16]), one);
+		uint32_t drawn = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(ids, limit), ids));
+		if (drawn) return k * 16 + 31 - __builtin_clz(drawn);
+	}
+#else
+	for (int16_t y = MAX_HEIGHT; y >= 0; y--)
+		if (bids[y] != 0 && bids[y] < tex->max_blockid) return y;
+#endif
+	return -1;
+}
+
+
+// find the column with the highest top block in a square of columns, and the height of that block,
+// which is -1 if none of them has a block to draw
+static inline uint16_t find_zoomed_column(const textures *tex, const chunk_data *chunk,
+		const uint8_t rbx, const uint8_t rbz, const uint8_t size, int16_t *top)
+{
+	uint16_t best = 0;
+	*top = -1;
+	for (uint8_t z = rbz; z < rbz + size; z++)
+		for (uint8_t x = rbx; x < rbx + size; x++)
+		{
+			uint16_t column = PADDED_COLUMN(x, z);
+			int16_t y = find_top_block(tex, &chunk->bids[column * CHUNK_BLOCK_HEIGHT]);
+			if (y > *top)
+			{
+				*top = y;
+				best = column;
+			}
+		}
+	return best;
+}
+
+
+// render an orthographic chunk at a reduced scale, drawing only the column with the highest top
+// block in each square of columns
+static inline void render_zoomed_ortho_chunk(image *img, const int32_t cpx, const int32_t cpy,
+		const textures *tex, chunk_data *chunk, const options *opts)
+{
+	uint8_t size = 1 << opts->zoom;
+	for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz += size)
+		for (uint8_t rbx = 0; rbx < CHUNK_BLOCK_LENGTH; rbx += size)
+		{
+			int16_t top;
+			uint16_t column = find_zoomed_column(tex, chunk, rbx, rbz, size, &top);
+			if (top >= 0)
+				render_ortho_column(img, cpx + (rbx >> opts->zoom), cpy + (rbz >> opts->zoom),
+						tex, chunk, column, opts);
+		}
+}
+
+
+#ifdef __SSE2__
+// render an orthographic chunk with a vector scan for the top block of each column: an opaque top
+// block over an empty pixel is the whole column, so it is shaded and stored straight away; other
+// columns fall back to the column walker
+static inline void render_ortho_chunk(image *img, const int32_t cpx, const int32_t cpy,
+		const textures *tex, chunk_data *chunk, const options *opts)
+{
+	for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz++)
+	{
+		// the chunk can start left of the image at the edge of a limited map, so keep the offset
+		// signed
+		uint8_t *pixels = &img->data[((cpy + rbz) * (int32_t)img->width + cpx) * CHANNELS];
+		for (uint8_t rbx = 0; rbx < CHUNK_BLOCK_LENGTH; rbx++)
+		{
+			uint16_t column = PADDED_COLUMN(rbx, rbz);
+			int16_t y = find_top_block(tex, &chunk->bids[column * CHUNK_BLOCK_HEIGHT]);
+			if (y < 0) continue;
+
+			uint32_t offset = column * CHUNK_BLOCK_HEIGHT + y;
+			uint8_t biome = opts->biomes ? chunk->biomes[column] : 0;
+			const uint8_t *colour = get_block_colour(tex, chunk->bids[offset],
+					chunk->bdata[offset], opts->biomes, biome);
+			uint8_t *pixel = &pixels[rbx * CHANNELS];
+			if (colour[ALPHA] < 255 || pixel[ALPHA] > 0)
+			{
+				render_ortho_column(img, cpx + rbx, cpy + rbz, tex, chunk, column, opts);
+				continue;
+			}
+
+			memcpy(pixel, colour, CHANNELS);
+			if (opts->biomes && chunk->tints != NULL && column_is_tinted(chunk, column))
+				tint_biome_colour(pixel, chunk, column, get_block_material(tex,
+						chunk->bids[offset], chunk->bdata[offset])->tint, 255);
+			shade_ortho_colour(pixel, y, get_ortho_contour(chunk, offset),
+					get_ortho_light(chunk, offset, y, opts->dark));
+		}
+	}
+}
+#endif
+
+
+void write_chunk_raster(raster *ras, const int32_t cpx, const int32_t cpy, const textures *tex,
+		chunk_data *chunk, const options *opts)
+{
+	// at a reduced scale, use the column that's drawn from each square of columns
+	uint8_t size = 1 << opts->zoom;
+	for (uint8_t rbz = 0; rbz < CHUNK_BLOCK_LENGTH; rbz += size)
+		for (uint8_t rbx = 0; rbx < CHUNK_BLOCK_LENGTH; rbx += size)
+		{
+			int16_t top;
+			uint16_t column = find_zoomed_column(tex, chunk, rbx, rbz, size, &top);
+			if (top < 0) continue;
+
+			uint16_t *value = &ras->data[(cpy + (rbz >> opts->zoom)) * ras->width +
+					cpx + (rbx >> opts->zoom)];
+			switch (opts->raster)
+			{
+			case RASTER_HEIGHT:
+				*value = top + 1;
+				break;
+			case RASTER_BIOME:
+				*value = chunk->biomes[column];
+				break;
+			case RASTER_LIGHT:
+				*value = top < MAX_HEIGHT ?
+						chunk->blight[column * CHUNK_BLOCK_HEIGHT + top + 1] : 0;
+				break;
+			}
+		}
+}
+
+
+// render a chunk's columns from bottom to top; this is inlined into a renderer for each
+// combination of rotate value and projection, so that the shape lookups are all constant
+static inline __attribute__((always_inline)) void render_chunk_columns(image *img,
+		coverage *cov, const int32_t cpx, const int32_t cpy, const textures *tex,
+		chunk_data *chunk, const options *opts, const uint8_t rotate, const bool isometric)
+{
+	// pixel offset and height of the part of a column that lies within the y limits
+	uint8_t ymin = opts->ylimits != NULL ? opts->ylimits[0] : 0;
+	uint8_t ymax = opts->ylimits != NULL ? opts->ylimits[1] : MAX_HEIGHT;
+	uint32_t ctop = (MAX_HEIGHT - ymax) * ISO_BLOCK_DEPTH;
+	uint32_t cheight = (ymax - ymin) * ISO_BLOCK_DEPTH + ISO_BLOCK_HEIGHT;
+
+	if (!isometric && opts->zoom)
+	{
+		render_zoomed_ortho_chunk(img, cpx, cpy, tex, chunk, opts);
+		return;
+	}
+#ifdef __SSE2__
+	if (!isometric)
+	{
+		render_ortho_chunk(img, cpx, cpy, tex, chunk, opts);
+		return;
+	}
+#endif
+
+	// find the isometric blocks that might be visible before drawing any of them
+	exposure exp;
+	if (isometric) get_exposed_blocks(&exp, tex, chunk, rotate);
+
+	// the chunk data is already rotated, so columns are stored in the order they are drawn
+	for (int8_t rbz = MAX_CHUNK_BLOCK; rbz >= 0; rbz--)
+		for (int8_t rbx = MAX_CHUNK_BLOCK; rbx >= 0; rbx--)
+			if (isometric)
+			{
+				// translate orthographic to isometric coordinates
+				int32_t px = cpx + (rbx + MAX_CHUNK_BLOCK - rbz) * ISO_BLOCK_WIDTH / 2;
+				int32_t py = cpy + (rbx + rbz) * ISO_BLOCK_TOP_HEIGHT;
+
+				// skip columns that would be hidden behind what's already been drawn
+				if (cov != NULL && pixels_covered(cov, px, py + ctop, cheight))
+					continue;
+
+				render_iso_column(img, cov, px, py, tex, chunk, &exp, PADDED_COLUMN(rbx, rbz),
+						opts, rotate);
+			}
+			else
+				render_ortho_column(img, cpx + rbx, cpy + rbz, tex, chunk, PADDED_COLUMN(rbx, rbz),
+						opts);
+}
+
+
+#define CHUNK_RENDERER(name, rotate, isometric) \
+	static void name(image *img, coverage *cov, const int32_t cpx, const int32_t cpy, \
+			const textures *tex, chunk_data *chunk, const options *opts) \
+	{ \
+		render_chunk_columns(img, cov, cpx, cpy, tex, chunk, opts, rotate, isometric); \
+	}
+
+CHUNK_RENDERER(render_ortho_chunk_r0, 0, 0)
+CHUNK_RENDERER(render_ortho_chunk_r1, 1, 0)
+CHUNK_RENDERER(render_ortho_chunk_r2, 2, 0)
+CHUNK_RENDERER(render_ortho_chunk_r3, 3, 0)
+CHUNK_RENDERER(render_iso_chunk_r0, 0, 1)
+CHUNK_RENDERER(render_iso_chunk_r1, 1, 1)
+CHUNK_RENDERER(render_iso_chunk_r2, 2, 1)
+CHUNK_RENDERER(render_iso_chunk_r3, 3, 1)
+
+static const chunk_renderer chunk_renderers[2][4] =
+{
+	{render_ortho_chunk_r0, render_ortho_chunk_r1, render_ortho_chunk_r2, render_ortho_chunk_r3},
+	{render_iso_chunk_r0,   render_iso_chunk_r1,   render_iso_chunk_r2,   render_iso_chunk_r3},
+};
+
+
+chunk_renderer get_chunk_renderer(const options *opts)
+{
+	return chunk_renderers[opts->isometric][opts->rotate];
+}
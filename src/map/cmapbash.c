@@ -32,9 +32,12 @@
 #include "data.h"
 #include "map.h"
 #include "image.h"
+#include "textures.h"
 
 
 #define TILESIZE 1024
+#define MAX_MAPS 8
+#define MAX_SLICES CHUNK_BLOCK_HEIGHT
 
 
 // save the map to a PNG file
@@ -65,9 +68,13 @@ static void save_world_map_slices(image *img, char *slicepath)
 
 	printf("Slicing image into %s...\n", slicepath);
 	mkdir(slicepath, S_IRWXU | S_IRWXG | S_IRWXO);
-	clock_t start = clock();
+	// tiles are encoded on several threads, so measure wall time rather than processor time
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	uint8_t zoomlevels = (uint8_t)ceil(log2((double)img->height / TILESIZE));
+	// an image no taller than one tile only needs the full size level
+	int zl = (int)ceil(log2((double)img->height / TILESIZE));
+	uint8_t zoomlevels = zl > 0 ? zl : 0;
 
 	image *zimg = img;
 	for (int8_t z = zoomlevels; z >= 0; z--)
@@ -88,17 +95,150 @@ static void save_world_map_slices(image *img, char *slicepath)
 		slice_image(zimg, TILESIZE, zoompath);
 
 		// replace image with 50% scaled version
-		image *nextimg;
+		image *nextimg = NULL;
 		if (z > 0)
 		{
 			printf("Scaling image by half\n");
 			nextimg = scale_image_half(zimg);
 		}
-		if (z < zoomlevels) free(zimg);
+		if (z < zoomlevels) free_image(zimg);
 		zimg = nextimg;
 	}
 
-	printf("Total save time: %f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Total save time: %f seconds\n",
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+
+// set up an extra map from a spec of the form <modes>:<path>, where the modes are any of the
+// letters i, d, s and b, and a path ending in a slash is a tile directory
+static bool parse_map_spec(options *mopts, char **outpath, char **slicepath, char *spec)
+{
+	char *sep = strchr(spec, ':');
+	if (sep == NULL || sep[1] == 0) return 0;
+
+	mopts->isometric = mopts->dark = mopts->shadows = mopts->biomes = mopts->tiny = 0;
+	for (char *m = spec; m < sep; m++)
+		switch (*m)
+		{
+		case 'i': mopts->isometric = 1; break;
+		case 'd': mopts->dark      = 1; break;
+		case 's': mopts->shadows   = 1; break;
+		case 'b': mopts->biomes    = 1; break;
+		default: return 0;
+		}
+	if (mopts->isometric) mopts->zoom = 0;
+
+	char *path = sep + 1;
+	bool dir = path[strlen(path) - 1] == '/';
+	*outpath   = dir ? NULL : path;
+	*slicepath = dir ? path : NULL;
+	return 1;
+}
+
+
+// names of the raster types, starting with RASTER_HEIGHT
+static const char *raster_names[] = {"height", "biome", "light"};
+
+
+// set up a raster from a spec of the form <type>:<path>, where the type is height, biome or light
+static bool parse_raster_spec(options *mopts, char **outpath, char *spec)
+{
+	char *sep = strchr(spec, ':');
+	if (sep == NULL || sep[1] == 0 || sep[strlen(sep) - 1] == '/') return 0;
+
+	mopts->raster = RASTER_NONE;
+	for (uint8_t i = 0; i < 3; i++)
+		if ((size_t)(sep - spec) == strlen(raster_names[i]) &&
+				!strncmp(spec, raster_names[i], sep - spec))
+			mopts->raster = RASTER_HEIGHT + i;
+	if (mopts->raster == RASTER_NONE) return 0;
+
+	// rasters line up with the orthographic map, and don't need any of its colours
+	mopts->isometric = mopts->dark = mopts->shadows = mopts->biomes = mopts->tiny = 0;
+	*outpath = sep + 1;
+	return 1;
+}
+
+
+// parse a comma-separated list of y ranges of the form <from>-<to>, or a single y coord, where a
+// range can end in /<height> to split it into slices that many blocks high, and return the
+// number of slices, or 0 if the list is invalid
+static uint16_t parse_yslices(uint8_t (*yslices)[2], char *arg)
+{
+	uint16_t count = 0;
+	for (char *range = strtok(arg, ","); range != NULL; range = strtok(NULL, ","))
+	{
+		int32_t from, to, height;
+		int n = sscanf(range, "%d-%d/%d", &from, &to, &height);
+		if (n < 1) return 0;
+		if (n < 2) to = from;
+		int32_t ymin = MIN(MAX(0, MIN(from, to)), MAX_HEIGHT);
+		int32_t ymax = MIN(MAX(0, MAX(from, to)), MAX_HEIGHT);
+		if (n < 3) height = ymax - ymin + 1;
+		if (height < 1) return 0;
+
+		for (int32_t y = ymin; y <= ymax; y += height)
+		{
+			if (count == MAX_SLICES) return 0;
+			yslices[count][0] = y;
+			yslices[count++][1] = MIN(y + height - 1, ymax);
+		}
+	}
+	return count;
+}
+
+
+// get the path for one of several variants of a map, by adding a suffix to the end of the file
+// name before its extension, or to the end of the directory name
+static char *get_suffixed_path(const char *path, const char *suffix)
+{
+	if (path == NULL) return NULL;
+
+	size_t length = strlen(path);
+	bool dir = path[length - 1] == '/';
+	if (dir) length--;
+	const char *ext = dir ? NULL : strrchr(path, '.');
+	const char *slash = strrchr(path, '/');
+	if (ext != NULL && slash != NULL && ext < slash) ext = NULL;
+
+	char *spath = (char*)malloc(length + strlen(suffix) + 2);
+	sprintf(spath, "%.*s%s%s", (int)(ext != NULL ? ext - path : length), path, suffix,
+			ext != NULL ? ext : (dir ? "/" : ""));
+	return spath;
+}
+
+
+// render several maps from a single pass over the world, and save each of them
+static int save_world_maps(char *inpath, const options *mopts, char **outpaths, char **slicepaths,
+		const uint16_t count)
+{
+	image **imgs = (image**)malloc(count * sizeof(image*));
+	raster **rasters = (raster**)malloc(count * sizeof(raster*));
+	if (!create_world_maps(imgs, rasters, inpath, mopts, count))
+	{
+		free(imgs);
+		free(rasters);
+		return 1;
+	}
+
+	for (uint16_t m = 0; m < count; m++)
+	{
+		if (rasters[m] != NULL)
+		{
+			printf("Saving raster to %s ...\n", outpaths[m]);
+			save_raster(rasters[m], outpaths[m]);
+			free_raster(rasters[m]);
+			continue;
+		}
+		if (outpaths[m] != NULL) save_world_map_image(imgs[m], outpaths[m]);
+		if (slicepaths[m] != NULL) save_world_map_slices(imgs[m], slicepaths[m]);
+		free_image(imgs[m]);
+	}
+	free(imgs);
+	free(rasters);
+	return 0;
 }
 
 
@@ -107,6 +247,9 @@ int main(int argc, char **argv)
 	char *inpath = NULL;
 	char *outpath = NULL;
 	char *slicepath = NULL;
+	char *compilepath = NULL;
+	bool stream = 0;
+	bool allrotate = 0;
 	static options opts =
 	{
 		.limits    = NULL,
@@ -114,8 +257,19 @@ int main(int argc, char **argv)
 		.texpath   = "resources/textures.csv",
 		.shapepath = "resources/shapes.csv",
 		.biomepath = "resources/biomes.csv",
+		.mappath   = "resources/blocktextures.csv",
+		.packpath  = NULL,
+		.respath   = NULL,
 	};
-	uint8_t rotateint;
+	int rotateint;
+	int zoomint;
+	int blendint;
+	char *specs[MAX_MAPS], *rspecs[MAX_MAPS];
+	uint8_t scount = 0, rcount = 0;
+	uint8_t yslices[MAX_SLICES][2];
+	uint16_t ycount = 0;
+	uint8_t ylimits[2];
+	int32_t limits[4];
 	int32_t fc = 0;
 	int32_t f1, f2, f3, fx, fy, fz;
 	int32_t tc = 0;
@@ -134,11 +288,20 @@ int main(int argc, char **argv)
 		{"nether",    no_argument, (int*)&opts.nether,    1},
 		{"end",       no_argument, (int*)&opts.end,       1},
 		{"rotate",    required_argument, 0, 'r'},
+		{"zoom",      required_argument, 0, 'z'},
+		{"biome-blend", required_argument, 0, 'B'},
 		{"world",     required_argument, 0, 'w'},
 		{"output",    required_argument, 0, 'o'},
 		{"googlemap", required_argument, 0, 'g'},
+		{"stream",    no_argument,       0, 'S'},
+		{"map",       required_argument, 0, 'M'},
 		{"from",      required_argument, 0, 'F'},
 		{"to",        required_argument, 0, 'T'},
+		{"slices",    required_argument, 0, 'Y'},
+		{"raster",    required_argument, 0, 'A'},
+		{"texture-pack", required_argument, 0, 'P'},
+		{"compile-textures", required_argument, 0, 'C'},
+		{"resource-pack", required_argument, 0, 'R'},
 		{0, 0, 0, 0}
 	};
 
@@ -146,7 +309,8 @@ int main(int argc, char **argv)
 	while (1)
 	{
 		int option_index = 2;
-		c = getopt_long(argc, argv, "-idsbtner:w:o:g:F:T:", long_options, &option_index);
+		c = getopt_long(argc, argv, "-idsbtner:z:B:w:o:g:SM:A:F:T:Y:P:C:R:", long_options,
+				&option_index);
 		if (c == -1) break;
 
 		switch (c)
@@ -184,12 +348,29 @@ int main(int argc, char **argv)
 			break;
 
 		case 'r':
-			if (sscanf(optarg, "%d", &rotateint))
-				opts.rotate = (unsigned char)rotateint % 4;
+			if (!strcmp(optarg, "all"))
+				allrotate = 1;
+			else if (sscanf(optarg, "%d", &rotateint) == 1)
+				opts.rotate = (uint8_t)rotateint % 4;
 			else
 				fprintf(stderr, "Invalid rotate argument: %s\n", optarg);
 			break;
 
+		case 'z':
+			if (sscanf(optarg, "%d", &zoomint) && zoomint >= 0 && zoomint <= MAX_ZOOM)
+				opts.zoom = zoomint;
+			else
+				fprintf(stderr, "Invalid zoom argument (must be 0 to %d): %s\n", MAX_ZOOM, optarg);
+			break;
+
+		case 'B':
+			if (sscanf(optarg, "%d", &blendint) && blendint >= 0 && blendint <= MAX_BLEND_RADIUS)
+				opts.blend = blendint;
+			else
+				fprintf(stderr, "Invalid biome blend argument (must be 0 to %d): %s\n",
+						MAX_BLEND_RADIUS, optarg);
+			break;
+
 		case 'w':
 			inpath = optarg;
 			break;
@@ -202,6 +383,25 @@ int main(int argc, char **argv)
 			slicepath = optarg;
 			break;
 
+		case 'S':
+			stream = 1;
+			break;
+
+		case 'M':
+			if (scount < MAX_MAPS)
+				specs[scount++] = optarg;
+			else
+				fprintf(stderr, "Too many maps (at most %d); ignoring -M %s\n", MAX_MAPS, optarg);
+			break;
+
+		case 'A':
+			if (rcount < MAX_MAPS)
+				rspecs[rcount++] = optarg;
+			else
+				fprintf(stderr, "Too many rasters (at most %d); ignoring -A %s\n", MAX_MAPS,
+						optarg);
+			break;
+
 		case 'F':
 			fc = sscanf(optarg, "%d,%d,%d", &f1, &f2, &f3);
 			if (!fc) fprintf(stderr, "Invalid 'from' coordinates: %s\n", optarg);
@@ -212,11 +412,39 @@ int main(int argc, char **argv)
 			if (!tc) fprintf(stderr, "Invalid 'to' coordinates: %s\n", optarg);
 			break;
 
+		case 'Y':
+			ycount = parse_yslices(yslices, optarg);
+			if (!ycount) fprintf(stderr, "Invalid y slices (at most %d): %s\n", MAX_SLICES, optarg);
+			break;
+
+		case 'P':
+			opts.packpath = optarg;
+			break;
+
+		case 'C':
+			compilepath = optarg;
+			break;
+
+		case 'R':
+			opts.respath = optarg;
+			break;
+
 		default:
 			abort();
 		}
 	}
 
+	if (compilepath != NULL)
+	{
+		printf("Compiling texture pack to %s ...\n", compilepath);
+		resource_colours *rescolours = opts.respath != NULL ?
+				read_resource_colours(opts.respath, opts.mappath) : NULL;
+		bool ok = write_texture_pack(compilepath, opts.texpath, opts.shapepath, opts.biomepath,
+				rescolours);
+		free(rescolours);
+		return !ok;
+	}
+
 	if (inpath == NULL)
 	{
 		fprintf(stderr, "Please specify a region directory with -w.\n");
@@ -224,17 +452,14 @@ int main(int argc, char **argv)
 	}
 
 	// default to single-image mode
-	if (outpath == NULL && slicepath == NULL) outpath = "map.png";
+	if (outpath == NULL && slicepath == NULL && scount == 0 && rcount == 0) outpath = "map.png";
 
 	if (fc != tc)
 		fprintf(stderr, "'From' and 'to' coordinates must be in the same format (X,Z or X,Y,Z).\n");
 	else if (fc == 1)
 	{
-		uint8_t ylimits[2] =
-		{
-			MAX(0, MIN(f1, t1)),
-			MIN(MAX_HEIGHT, MAX(f1, t1)),
-		};
+		ylimits[0] = MAX(0, MIN(f1, t1));
+		ylimits[1] = MIN(MAX_HEIGHT, MAX(f1, t1));
 		opts.ylimits = ylimits;
 	}
 	else if (fc > 1)
@@ -246,11 +471,8 @@ int main(int argc, char **argv)
 			fz = f3;
 			tz = t3;
 
-			uint8_t ylimits[2] =
-			{
-				MAX(0, MIN(f2, t2)),
-				MIN(MAX_HEIGHT, MAX(f2, t2)),
-			};
+			ylimits[0] = MAX(0, MIN(f2, t2));
+			ylimits[1] = MIN(MAX_HEIGHT, MAX(f2, t2));
 			opts.ylimits = ylimits;
 		}
 		else
@@ -259,13 +481,10 @@ int main(int argc, char **argv)
 			tz = t2;
 		}
 
-		int32_t limits[4] =
-		{
-			MIN(fz, tz),
-			MAX(fx, tx),
-			MAX(fz, tz),
-			MIN(fx, tx),
-		};
+		limits[0] = MIN(fz, tz);
+		limits[1] = MAX(fx, tx);
+		limits[2] = MAX(fz, tz);
+		limits[3] = MIN(fx, tx);
 		opts.limits = limits;
 
 		if (opts.ylimits == NULL)
@@ -276,14 +495,28 @@ int main(int argc, char **argv)
 					fx, opts.ylimits[0], fz, tx, opts.ylimits[1], tz);
 	}
 
-	if (opts.rotate) printf("Rotating %d degrees clockwise\n", opts.rotate * 90);
+	if (ycount > 0)
+	{
+		if (opts.ylimits != NULL)
+			fprintf(stderr, "Y slices replace the y coords given with -F and -T.\n");
+		printf("Rendering %d y slices\n", ycount);
+	}
+
+	if (allrotate) printf("Rendering all four rotations\n");
+	else if (opts.rotate) printf("Rotating %d degrees clockwise\n", opts.rotate * 90);
+
+	if (opts.zoom && (opts.isometric || opts.tiny))
+	{
+		fprintf(stderr, "Zooming out only works in orthographic mode; ignoring -z.\n");
+		opts.zoom = 0;
+	}
 
 	if (opts.tiny)
 	{
 		printf("Rendering in tiny mode.\n");
 		opts.isometric = 0;
 	}
-	else
+	else if (outpath != NULL || slicepath != NULL)
 	{
 		printf("Rendering in %s mode\n", opts.isometric ? "isometric" : "orthographic");
 
@@ -291,11 +524,126 @@ int main(int argc, char **argv)
 		else if (opts.isometric && opts.shadows) printf("Daytime shadows are on\n");
 
 		if (opts.biomes) printf("Biomes are on\n");
+		if (opts.biomes && opts.blend)
+			printf("Blending biome colours over %d blocks each way\n", opts.blend);
+
+		if (opts.zoom) printf("Zoomed out to 1:%d\n", 1 << opts.zoom);
 
 		if (opts.nether) printf("Rendering nether dimension\n");
 		else if (opts.end) printf("Rendering end dimension\n");
 	}
 
+	if (scount > 0 || rcount > 0 || allrotate || ycount > 0)
+	{
+		// the main options make a map of their own only if they were given an output
+		uint16_t size = (MAX_MAPS * 2 + 1) * MAX(ycount, 1) * (allrotate ? 4 : 1);
+		options *mopts = (options*)malloc(size * sizeof(options));
+		char **outpaths = (char**)malloc(size * sizeof(char*));
+		char **slicepaths = (char**)malloc(size * sizeof(char*));
+		uint16_t count = 0;
+		if (outpath != NULL || slicepath != NULL)
+		{
+			mopts[count] = opts;
+			outpaths[count] = outpath;
+			slicepaths[count++] = slicepath;
+		}
+		for (uint8_t s = 0; s < scount; s++)
+		{
+			mopts[count] = opts;
+			if (!parse_map_spec(&mopts[count], &outpaths[count], &slicepaths[count], specs[s]))
+			{
+				fprintf(stderr, "Invalid map argument (must be <modes>:<path>): %s\n", specs[s]);
+				continue;
+			}
+			printf("Also rendering %s%s%s%s map to %s\n",
+					mopts[count].isometric ? "isometric" : "orthographic",
+					mopts[count].dark ? ", dark" : "",
+					mopts[count].isometric && !mopts[count].dark && mopts[count].shadows ?
+							", shadowed" : "",
+					mopts[count].biomes ? ", biome" : "",
+					outpaths[count] != NULL ? outpaths[count] : slicepaths[count]);
+			count++;
+		}
+		for (uint8_t s = 0; s < rcount; s++)
+		{
+			mopts[count] = opts;
+			slicepaths[count] = NULL;
+			if (!parse_raster_spec(&mopts[count], &outpaths[count], rspecs[s]))
+			{
+				fprintf(stderr, "Invalid raster argument (must be height, biome or light, then "
+						":<path>): %s\n", rspecs[s]);
+				continue;
+			}
+			printf("Also writing %s raster to %s\n", raster_names[mopts[count].raster - 1],
+					outpaths[count]);
+			count++;
+		}
+		if (count == 0) return 1;
+
+		// replace each map with one for each y slice, and then with one for each rotate value,
+		// working backwards to make room
+		char suffix[16];
+		if (ycount > 0)
+		{
+			for (int32_t m = count - 1; m >= 0; m--)
+				for (int32_t y = ycount - 1; y >= 0; y--)
+				{
+					mopts[m * ycount + y] = mopts[m];
+					mopts[m * ycount + y].ylimits = yslices[y];
+					sprintf(suffix, "-y%d-%d", yslices[y][0], yslices[y][1]);
+					outpaths[m * ycount + y] = get_suffixed_path(outpaths[m], suffix);
+					slicepaths[m * ycount + y] = get_suffixed_path(slicepaths[m], suffix);
+				}
+			count *= ycount;
+		}
+		if (allrotate)
+		{
+			for (int32_t m = count - 1; m >= 0; m--)
+			{
+				char *moutpath = outpaths[m], *mslicepath = slicepaths[m];
+				for (int8_t r = 3; r >= 0; r--)
+				{
+					mopts[m * 4 + r] = mopts[m];
+					mopts[m * 4 + r].rotate = r;
+					sprintf(suffix, "-r%d", r);
+					outpaths[m * 4 + r] = get_suffixed_path(moutpath, suffix);
+					slicepaths[m * 4 + r] = get_suffixed_path(mslicepath, suffix);
+				}
+				// the paths with y slice suffixes were our own copies
+				if (ycount > 0)
+				{
+					free(moutpath);
+					free(mslicepath);
+				}
+			}
+			count *= 4;
+		}
+
+		if (stream) fprintf(stderr, "Streaming only works with a single map; ignoring -S.\n");
+		int status = save_world_maps(inpath, mopts, outpaths, slicepaths, count);
+
+		if (allrotate || ycount > 0)
+			for (uint16_t m = 0; m < count; m++)
+			{
+				free(outpaths[m]);
+				free(slicepaths[m]);
+			}
+		free(mopts);
+		free(outpaths);
+		free(slicepaths);
+		return status;
+	}
+
+	if (stream)
+	{
+		if (slicepath == NULL && !opts.tiny)
+		{
+			printf("Streaming image to %s ...\n", outpath);
+			return stream_world_map(inpath, outpath, &opts) ? 0 : 1;
+		}
+		fprintf(stderr, "Streaming only works with single image output; ignoring -S.\n");
+	}
+
 	image *img = create_world_map(inpath, &opts);
 	if (img == NULL) return 1;
 
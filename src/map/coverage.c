@@ -0,0 +1,154 @@
+/*
+	cmapbash - a simple Minecraft map renderer written in C.
+	© 2014 saltire sable, x@saltiresable.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "map.h"
+
+
+// clear the pixel bitmap, except for the padding past the image's right and bottom edges,
+// which is marked as opaque so that cells on those edges can still be covered
+static void reset_pixels(coverage *cov)
+{
+	uint32_t rows = cov->height << COVERAGE_CELL_BITS;
+	uint32_t cols = cov->width  << COVERAGE_CELL_BITS;
+
+	memset(cov->pixels, 0, cov->pheight * cov->pstride);
+	memset(&cov->pixels[cov->pheight * cov->pstride], 0xff, (rows - cov->pheight) * cov->pstride);
+	for (uint32_t y = 0; y < cov->pheight; y++)
+		for (uint32_t x = cov->pwidth; x < cols; x++)
+			set_opaque_pixel(cov, x, y);
+}
+
+
+coverage *create_coverage(const image *img)
+{
+	coverage *cov = (coverage*)malloc(sizeof(coverage));
+	cov->pwidth  = img->width;
+	cov->pheight = img->height;
+	cov->width   = (img->width  + COVERAGE_CELL_SIZE - 1) >> COVERAGE_CELL_BITS;
+	cov->height  = (img->height + COVERAGE_CELL_SIZE - 1) >> COVERAGE_CELL_BITS;
+	cov->stride  = (cov->width + 63) >> 6;
+	cov->twidth  = (cov->width  + COVERAGE_TILE_SIZE - 1) >> COVERAGE_TILE_BITS;
+	cov->theight = (cov->height + COVERAGE_TILE_SIZE - 1) >> COVERAGE_TILE_BITS;
+	// one spare byte on each pixel row lets a row of four pixels always be read as two bytes
+	cov->pstride = (((cov->width << COVERAGE_CELL_BITS) + 7) >> 3) + 1;
+	cov->cells  = (uint64_t*)calloc(cov->stride * cov->height, sizeof(uint64_t));
+	cov->tiles  = (uint16_t*)calloc(cov->twidth * cov->theight, sizeof(uint16_t));
+	cov->pixels = (uint8_t*)malloc((cov->height << COVERAGE_CELL_BITS) * cov->pstride);
+	reset_pixels(cov);
+	return cov;
+}
+
+
+void clear_coverage(coverage *cov)
+{
+	memset(cov->cells, 0, cov->stride * cov->height * sizeof(uint64_t));
+	memset(cov->tiles, 0, cov->twidth * cov->theight * sizeof(uint16_t));
+	reset_pixels(cov);
+}
+
+
+void free_coverage(coverage *cov)
+{
+	if (cov == NULL) return;
+	free(cov->cells);
+	free(cov->tiles);
+	free(cov->pixels);
+	free(cov);
+}
+
+
+// convert a pixel rectangle to an inclusive range of cells, clipped to the image
+// returns false if none of the rectangle is inside the image
+static bool get_cell_range(uint32_t *range, const coverage *cov, const int32_t x, const int32_t y,
+		const uint32_t w, const uint32_t h)
+{
+	int64_t x1 = MIN((int64_t)x + w, (int64_t)cov->width  << COVERAGE_CELL_BITS) - 1;
+	int64_t y1 = MIN((int64_t)y + h, (int64_t)cov->height << COVERAGE_CELL_BITS) - 1;
+	if (x1 < 0 || y1 < 0 || x1 < x || y1 < y) return 0;
+
+	range[0] = MAX(x, 0) >> COVERAGE_CELL_BITS;
+	range[1] = MAX(y, 0) >> COVERAGE_CELL_BITS;
+	range[2] = x1 >> COVERAGE_CELL_BITS;
+	range[3] = y1 >> COVERAGE_CELL_BITS;
+	return 1;
+}
+
+
+// number of cells in a tile, which is less than a full tile on the right and bottom edges
+static inline uint16_t get_tile_area(const coverage *cov, const uint32_t tx, const uint32_t ty)
+{
+	return MIN(COVERAGE_TILE_SIZE, cov->width  - (tx << COVERAGE_TILE_BITS)) *
+			MIN(COVERAGE_TILE_SIZE, cov->height - (ty << COVERAGE_TILE_BITS));
+}
+
+
+void update_coverage(coverage *cov, const int32_t x, const int32_t y, const uint32_t w,
+		const uint32_t h)
+{
+	uint32_t range[4];
+	if (!get_cell_range(range, cov, x, y, w, h)) return;
+
+	for (uint32_t cy = range[1]; cy <= range[3]; cy++)
+	{
+		uint64_t *row = &cov->cells[cy * cov->stride];
+		for (uint32_t cx = range[0]; cx <= range[2]; cx++)
+		{
+			// cells never become transparent again, so there is no need to check them twice
+			if (row[cx >> 6] & (1ULL << (cx & 63)) || !pixels_covered(cov,
+					cx << COVERAGE_CELL_BITS, cy << COVERAGE_CELL_BITS, COVERAGE_CELL_SIZE))
+				continue;
+			row[cx >> 6] |= 1ULL << (cx & 63);
+			cov->tiles[(cy >> COVERAGE_TILE_BITS) * cov->twidth + (cx >> COVERAGE_TILE_BITS)]++;
+		}
+	}
+}
+
+
+bool is_covered(const coverage *cov, const int32_t x, const int32_t y, const uint32_t w,
+		const uint32_t h)
+{
+	// nothing can be drawn outside the image, so that part always counts as covered
+	uint32_t range[4];
+	if (!get_cell_range(range, cov, x, y, w, h)) return 1;
+
+	for (uint32_t ty = range[1] >> COVERAGE_TILE_BITS; ty <= range[3] >> COVERAGE_TILE_BITS; ty++)
+		for (uint32_t tx = range[0] >> COVERAGE_TILE_BITS; tx <= range[2] >> COVERAGE_TILE_BITS;
+				tx++)
+		{
+			// skip tiles whose cells are all opaque, otherwise check the cells they share
+			// with the rectangle
+			if (cov->tiles[ty * cov->twidth + tx] == get_tile_area(cov, tx, ty)) continue;
+
+			uint32_t cy1 = MIN(range[3], ((ty + 1) << COVERAGE_TILE_BITS) - 1);
+			uint32_t cx1 = MIN(range[2], ((tx + 1) << COVERAGE_TILE_BITS) - 1);
+			for (uint32_t cy = MAX(range[1], ty << COVERAGE_TILE_BITS); cy <= cy1; cy++)
+			{
+				const uint64_t *row = &cov->cells[cy * cov->stride];
+				for (uint32_t cx = MAX(range[0], tx << COVERAGE_TILE_BITS); cx <= cx1; cx++)
+					if (!(row[cx >> 6] & (1ULL << (cx & 63)))) return 0;
+			}
+		}
+	return 1;
+}
@@ -17,16 +17,56 @@
 */
 
 
+#define _XOPEN_SOURCE 500 // for pthreads and sysconf
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <zlib.h>
 
 #include "lodepng.h"
 
 #include "image.h"
 
 
+#define MAX_TILE_WORKERS 16 // most threads to encode tiles with, however many processors there are
+
+
+// a tile that has been encoded as a PNG file in memory, waiting to be written
+typedef struct encoded_tile
+{
+	uint8_t *png; // pointer to the encoded file, or NULL if encoding it failed
+	size_t size;  // size of the encoded file in bytes
+	bool ready;   // whether the tile in this slot has been encoded and not yet taken
+}
+encoded_tile;
+
+// a bounded queue of tiles shared by the threads that encode them and the one that writes them;
+// each tile is encoded into the slot for its index, and never more than the queue's length ahead
+// of the next one to be written, so the writer can take them in order
+typedef struct tile_queue
+{
+	const image *img;       // pointer to the image being sliced
+	uint32_t tilesize;      // length and width of each tile
+	uint32_t columns;       // number of tiles in each row of the image
+	uint32_t count;         // number of tiles in the image
+	uint32_t next;          // index of the next tile to be encoded
+	uint32_t written;       // number of tiles taken by the writer so far
+	uint32_t length;        // number of slots in the queue
+	encoded_tile *slots;    // array of slots, indexed by tile index modulo the queue's length
+	pthread_mutex_t lock;   // lock for everything above that changes
+	pthread_cond_t encoded; // signalled when a tile is put in its slot
+	pthread_cond_t taken;   // signalled when the writer takes a tile, freeing its slot
+}
+tile_queue;
+
+
 image *create_image(const uint32_t width, const uint32_t height)
 {
 	image *img = (image*)malloc(sizeof(image));
@@ -37,17 +77,230 @@ image *create_image(const uint32_t width, const uint32_t height)
 }
 
 
+// divide the colour channels of some premultiplied pixels by their alpha, to get the straight
+// alpha values that PNG files store
+static void unpremultiply_pixels(uint8_t *out, const uint8_t *data, const size_t count)
+{
+	for (size_t p = 0; p < count * CHANNELS; p += CHANNELS)
+	{
+		uint8_t alpha = data[p + ALPHA];
+		if (alpha == 255 || alpha == 0)
+			memcpy(&out[p], &data[p], CHANNELS);
+		else
+		{
+			for (uint8_t c = 0; c < ALPHA; c++)
+			{
+				uint32_t value = (data[p + c] * 255 + alpha / 2) / alpha;
+				out[p + c] = value > 255 ? 255 : value;
+			}
+			out[p + ALPHA] = alpha;
+		}
+	}
+}
+
+
 image *load_image(const char *imgpath)
 {
 	image *img = (image*)malloc(sizeof(image));
-	lodepng_decode32_file(&img->data, &img->width, &img->height, imgpath);
+	unsigned error = lodepng_decode32_file(&img->data, &img->width, &img->height, imgpath);
+	if (error)
+	{
+		fprintf(stderr, "Error decoding %s: %s\n", imgpath, lodepng_error_text(error));
+		free(img->data);
+		free(img);
+		return NULL;
+	}
+	for (size_t p = 0; p < (size_t)img->width * img->height * CHANNELS; p += CHANNELS)
+		premultiply_pixel(&img->data[p]);
 	return img;
 }
 
 
 void save_image(const image *img, const char *imgpath)
 {
-	lodepng_encode32_file(imgpath, img->data, img->width, img->height);
+	uint8_t *data = (uint8_t*)malloc(img->width * img->height * CHANNELS);
+	unpremultiply_pixels(data, img->data, img->width * img->height);
+	lodepng_encode32_file(imgpath, data, img->width, img->height);
+	free(data);
+}
+
+
+// write a single PNG chunk, with its length and checksum, and note if the write fails
+static void write_png_chunk(png_stream *png, const char *type, const uint8_t *data,
+		const uint32_t length)
+{
+	uint32_t crc = crc32(crc32(0, (const Bytef*)type, 4), data, length);
+	uint8_t header[8] = {length >> 24, length >> 16, length >> 8, length,
+			type[0], type[1], type[2], type[3]};
+	uint8_t footer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+
+	if (fwrite(header, 1, 8, png->file) != 8 || fwrite(data, 1, length, png->file) != length ||
+			fwrite(footer, 1, 4, png->file) != 4)
+		png->error = 1;
+}
+
+
+// compress some image data, writing an IDAT chunk each time the output buffer fills up
+static void deflate_png_data(png_stream *png, const uint8_t *data, const uint32_t length,
+		const int flush)
+{
+	png->zs.next_in = (Bytef*)data;
+	png->zs.avail_in = length;
+
+	int status;
+	do
+	{
+		status = deflate(&png->zs, flush);
+		if (status == Z_STREAM_ERROR)
+		{
+			png->error = 1;
+			return;
+		}
+		if (png->zs.avail_out == 0 || status == Z_STREAM_END)
+		{
+			write_png_chunk(png, "IDAT", png->out, PNG_CHUNK_BYTES - png->zs.avail_out);
+			png->zs.next_out = png->out;
+			png->zs.avail_out = PNG_CHUNK_BYTES;
+		}
+	}
+	while (png->zs.avail_in > 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+}
+
+
+// predict a byte from its left, upper and upper left neighbours
+static uint8_t paeth_predictor(const int16_t a, const int16_t b, const int16_t c)
+{
+	int16_t pa = abs(b - c);
+	int16_t pb = abs(a - c);
+	int16_t pc = abs(a + b - c * 2);
+	return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+
+// apply a PNG filter type to a scanline, and return the sum of the filtered bytes as signed values
+static uint32_t filter_png_row(uint8_t *out, const uint8_t *row, const uint8_t *prev,
+		const uint32_t length, const uint8_t type)
+{
+	uint32_t sum = 0;
+	out[0] = type;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		uint8_t a = i < CHANNELS ? 0 : row[i - CHANNELS];
+		uint8_t b = prev[i];
+		uint8_t c = i < CHANNELS ? 0 : prev[i - CHANNELS];
+
+		uint8_t predicted;
+		switch (type)
+		{
+		case 0:
+			predicted = 0;
+			break;
+		case 1:
+			predicted = a;
+			break;
+		case 2:
+			predicted = b;
+			break;
+		case 3:
+			predicted = (a + b) / 2;
+			break;
+		default: // 4
+			predicted = paeth_predictor(a, b, c);
+			break;
+		}
+
+		out[i + 1] = row[i] - predicted;
+		sum += out[i + 1] < 128 ? out[i + 1] : 256 - out[i + 1];
+	}
+	return sum;
+}
+
+
+png_stream *open_png_stream(const char *imgpath, const uint32_t width, const uint32_t height)
+{
+	png_stream *png = (png_stream*)malloc(sizeof(png_stream));
+	png->file = fopen(imgpath, "wb");
+	if (png->file == NULL)
+	{
+		fprintf(stderr, "Error %d writing image file: %s\n", errno, imgpath);
+		free(png);
+		return NULL;
+	}
+
+	png->width = width;
+	png->height = height;
+	png->row = 0;
+	png->error = 0;
+
+	size_t length = width * CHANNELS;
+	png->straight = (uint8_t*)malloc(length);
+	png->prev = (uint8_t*)calloc(length, 1);
+	png->filtered = (uint8_t*)malloc(length + 1);
+	png->trial = (uint8_t*)malloc(length + 1);
+
+	memset(&png->zs, 0, sizeof(z_stream));
+	if (deflateInit(&png->zs, Z_DEFAULT_COMPRESSION) != Z_OK) png->error = 1;
+	png->zs.next_out = png->out;
+	png->zs.avail_out = PNG_CHUNK_BYTES;
+
+	// signature and header: 8-bit RGBA, no interlacing
+	const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	if (fwrite(signature, 1, 8, png->file) != 8) png->error = 1;
+	uint8_t ihdr[13] = {width >> 24, width >> 16, width >> 8, width,
+			height >> 24, height >> 16, height >> 8, height, 8, 6, 0, 0, 0};
+	write_png_chunk(png, "IHDR", ihdr, 13);
+
+	return png;
+}
+
+
+void write_png_rows(png_stream *png, const uint8_t *data, const uint32_t rows)
+{
+	uint32_t length = png->width * CHANNELS;
+	for (uint32_t r = 0; r < rows && png->row < png->height; r++, png->row++)
+	{
+		const uint8_t *row = png->straight;
+		unpremultiply_pixels(png->straight, &data[r * length], png->width);
+
+		// choose the filter type that gives the lowest sum of signed bytes
+		uint32_t best = filter_png_row(png->filtered, row, png->prev, length, 0);
+		for (uint8_t type = 1; type < 5; type++)
+		{
+			uint32_t sum = filter_png_row(png->trial, row, png->prev, length, type);
+			if (sum < best)
+			{
+				best = sum;
+				uint8_t *swap = png->filtered;
+				png->filtered = png->trial;
+				png->trial = swap;
+			}
+		}
+
+		deflate_png_data(png, png->filtered, length + 1, Z_NO_FLUSH);
+		memcpy(png->prev, row, length);
+	}
+}
+
+
+bool close_png_stream(png_stream *png)
+{
+	if (png->row < png->height)
+		fprintf(stderr, "Image stream closed after %d of %d rows.\n", png->row, png->height);
+
+	if (!png->error) deflate_png_data(png, NULL, 0, Z_FINISH);
+	deflateEnd(&png->zs);
+	write_png_chunk(png, "IEND", (const uint8_t*)"", 0);
+
+	if (fclose(png->file)) png->error = 1;
+	bool ok = !png->error;
+	if (!ok) fprintf(stderr, "Error writing image stream.\n");
+
+	free(png->straight);
+	free(png->prev);
+	free(png->filtered);
+	free(png->trial);
+	free(png);
+	return ok;
 }
 
 
@@ -88,44 +341,197 @@ image *scale_image_half(const image *img)
 }
 
 
+// copy a tile out of an image, converted to straight alpha and padded with transparent pixels
+// past the image's edges, and encode it as a PNG file in memory
+static void encode_tile(encoded_tile *tile, uint8_t *data, const tile_queue *q, const uint32_t t)
+{
+	const image *img = q->img;
+	uint32_t x = t % q->columns * q->tilesize, y = t / q->columns * q->tilesize;
+
+	// copy the lesser of the tile width, or the remainder of the image width
+	uint32_t length = (x + q->tilesize > img->width) ? img->width - x : q->tilesize;
+
+	memset(data, 0, q->tilesize * q->tilesize * CHANNELS);
+	for (uint32_t ty = 0; ty < q->tilesize && y + ty < img->height; ty++)
+		unpremultiply_pixels(&data[ty * q->tilesize * CHANNELS],
+				&img->data[((y + ty) * img->width + x) * CHANNELS], length);
+
+	unsigned error = lodepng_encode32(&tile->png, &tile->size, data, q->tilesize, q->tilesize);
+	if (error)
+	{
+		fprintf(stderr, "Error encoding tile %d: %s\n", t, lodepng_error_text(error));
+		free(tile->png);
+		tile->png = NULL;
+	}
+}
+
+
+// worker thread that encodes the next tile until there are none left, waiting whenever it would
+// get too far ahead of the writer
+static void *encode_tiles(void *arg)
+{
+	tile_queue *q = (tile_queue*)arg;
+	uint8_t *data = (uint8_t*)malloc(q->tilesize * q->tilesize * CHANNELS);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->next < q->count)
+	{
+		uint32_t t = q->next++;
+		while (t >= q->written + q->length) pthread_cond_wait(&q->taken, &q->lock);
+		pthread_mutex_unlock(&q->lock);
+
+		encoded_tile tile;
+		encode_tile(&tile, data, q, t);
+
+		pthread_mutex_lock(&q->lock);
+		tile.ready = 1;
+		q->slots[t % q->length] = tile;
+		pthread_cond_broadcast(&q->encoded);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	free(data);
+	return NULL;
+}
+
+
+// write an encoded tile to a temporary file next to its path, and rename it into place once it
+// is complete, so that a tile file is never seen half written
+static void write_tile(const char *tilepath, const encoded_tile *tile)
+{
+	if (tile->png == NULL) return;
+
+	char tmppath[260];
+	sprintf(tmppath, "%s.tmp", tilepath);
+	FILE *file = fopen(tmppath, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error %d writing tile: %s\n", errno, tmppath);
+		return;
+	}
+	bool ok = fwrite(tile->png, tile->size, 1, file) == 1;
+	ok &= fclose(file) == 0;
+	if (!ok || rename(tmppath, tilepath))
+	{
+		fprintf(stderr, "Error %d writing tile: %s\n", errno, tilepath);
+		remove(tmppath);
+	}
+}
+
+
 void slice_image(const image *img, const uint32_t tilesize, const char *tiledir)
 {
-	uint32_t t = 0;
-	uint32_t count = (
-		((img->width + tilesize - 1) / tilesize) *
-		((img->height + tilesize - 1) / tilesize)
-	);
+	tile_queue q = {
+		.img      = img,
+		.tilesize = tilesize,
+		.columns  = (img->width + tilesize - 1) / tilesize,
+		.count    = ((img->width + tilesize - 1) / tilesize) *
+				((img->height + tilesize - 1) / tilesize),
+	};
+
+	// encode on a thread for each processor, keeping a couple of tiles queued up for each
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t wcount = cpus < 1 ? 1 : cpus > MAX_TILE_WORKERS ? MAX_TILE_WORKERS : cpus;
+	if (wcount > q.count) wcount = q.count;
+	q.length = wcount * 2;
+	q.slots = (encoded_tile*)calloc(q.length, sizeof(encoded_tile));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.encoded, NULL);
+	pthread_cond_init(&q.taken, NULL);
 
-	for (uint32_t y = 0; y < img->height; y += tilesize)
+	pthread_t workers[MAX_TILE_WORKERS];
+	uint32_t started = 0;
+	while (started < wcount && !pthread_create(&workers[started], NULL, encode_tiles, &q))
+		started++;
+	uint8_t *data = started ? NULL : (uint8_t*)malloc(tilesize * tilesize * CHANNELS);
+
+	// write the tiles in order as they come out of the queue, or encode them here if no threads
+	// could be started
+	for (uint32_t t = 0; t < q.count; t++)
 	{
-		for (uint32_t x = 0; x < img->width; x += tilesize)
+		encoded_tile tile;
+		if (started)
 		{
-			t++;
-			uint32_t tilex = x / tilesize;
-			uint32_t tiley = y / tilesize;
-			printf("Saving tile %d/%d (%d,%d)...\n", t, count, tilex, tiley);
+			pthread_mutex_lock(&q.lock);
+			encoded_tile *slot = &q.slots[t % q.length];
+			while (!slot->ready) pthread_cond_wait(&q.encoded, &q.lock);
+			tile = *slot;
+			slot->ready = 0;
+			q.written++;
+			pthread_cond_broadcast(&q.taken);
+			pthread_mutex_unlock(&q.lock);
+		}
+		else
+			encode_tile(&tile, data, &q, t);
 
-			image *tile = create_image(tilesize, tilesize);
+		uint32_t tilex = t % q.columns;
+		uint32_t tiley = t / q.columns;
+		printf("Saving tile %d/%d (%d,%d)...\n", t + 1, q.count, tilex, tiley);
 
-			// copy the lesser of the tile width, or the remainder of the image width
-			uint32_t length = (x + tilesize > img->width) ? img->width - x : tilesize;
+		char tilepath[255];
+		sprintf(tilepath, "%s/%d.%d.png", tiledir, tilex, tiley);
+		write_tile(tilepath, &tile);
+		free(tile.png);
+	}
 
-			for (uint32_t ty = 0; ty < tilesize; ty++)
-			{
-				// if we're past the bottom of the main image, stop rendering this tile
-				if (y + ty == img->height) break;
+	for (uint32_t w = 0; w < started; w++) pthread_join(workers[w], NULL);
+	pthread_mutex_destroy(&q.lock);
+	pthread_cond_destroy(&q.encoded);
+	pthread_cond_destroy(&q.taken);
+	free(q.slots);
+	free(data);
+}
 
-				uint8_t *row = &img->data[((y + ty) * img->width + x) * CHANNELS];
-				uint8_t *trow = &tile->data[ty * tilesize * CHANNELS];
 
-				memcpy(trow, row, length * CHANNELS);
-			}
+raster *create_raster(const uint32_t width, const uint32_t height)
+{
+	raster *ras = (raster*)malloc(sizeof(raster));
+	ras->width = width;
+	ras->height = height;
+	ras->data = (uint16_t*)calloc(width * height, sizeof(uint16_t));
+	return ras;
+}
 
-			char tilepath[255];
-			sprintf(tilepath, "%s/%d.%d.png", tiledir, tilex, tiley);
-			save_image(tile, tilepath);
 
-			free_image(tile);
+void save_raster(const raster *ras, const char *raspath)
+{
+	// PNG files store 16-bit samples big-endian, and raw files get them little-endian
+	size_t length = strlen(raspath);
+	bool png = length >= 4 && !strcmp(&raspath[length - 4], ".png");
+	size_t count = (size_t)ras->width * ras->height;
+	uint8_t *data = (uint8_t*)malloc(count * 2);
+	for (size_t p = 0; p < count; p++)
+	{
+		data[p * 2 + !png] = ras->data[p] >> 8;
+		data[p * 2 + png]  = ras->data[p] & 0xff;
+	}
+
+	if (png)
+	{
+		unsigned error = lodepng_encode_file(raspath, data, ras->width, ras->height, LCT_GREY, 16);
+		if (error)
+			fprintf(stderr, "Error writing raster file %s: %s\n", raspath,
+					lodepng_error_text(error));
+	}
+	else
+	{
+		FILE *file = fopen(raspath, "wb");
+		if (file == NULL)
+			fprintf(stderr, "Error %d writing raster file: %s\n", errno, raspath);
+		else
+		{
+			bool ok = fwrite(data, 2, count, file) == count;
+			ok &= fclose(file) == 0;
+			if (!ok) fprintf(stderr, "Error writing raster file: %s\n", raspath);
 		}
 	}
+	free(data);
+}
+
+
+void free_raster(raster *ras)
+{
+	if (ras == NULL) return;
+	free(ras->data);
+	free(ras);
 }
@@ -21,35 +21,98 @@
 #define IMAGE_H
 
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include <zlib.h>
 
 
 #define CHANNELS 4
 #define ALPHA (CHANNELS - 1)
 
+#define PNG_CHUNK_BYTES 65536
+
+
+// multiply a channel value by an alpha value, rounding to the nearest integer without dividing
+static inline uint8_t scale_channel(const uint8_t value, const uint8_t alpha)
+{
+	uint32_t v = value * alpha + 128;
+	return (v + (v >> 8)) >> 8;
+}
+
+// multiply the colour channels of a straight alpha pixel by its alpha
+static inline void premultiply_pixel(uint8_t *pixel)
+{
+	for (uint8_t c = 0; c < ALPHA; c++)
+		pixel[c] = scale_channel(pixel[c], pixel[ALPHA]);
+}
+
 
 typedef struct image {
 	uint32_t width, height; // pixel dimensions of the image
-	uint8_t* data;          // pointer to an RGBA pixel buffer for the image
+	uint8_t* data;          // pointer to an RGBA pixel buffer for the image, with each colour
+	                        //   channel premultiplied by the pixel's alpha
 } image;
 
+// a single channel of 16-bit values aligned pixel for pixel with a map image
+typedef struct raster {
+	uint32_t width, height; // pixel dimensions of the raster
+	uint16_t *data;         // pointer to a buffer of one value for each pixel
+} raster;
+
+// a PNG file being written one scanline at a time
+typedef struct png_stream {
+	FILE *file;                         // handle for the output file
+	uint32_t width, height;             // pixel dimensions of the image
+	uint32_t row;                       // number of scanlines written so far
+	bool error;                         // whether compressing or writing any data has failed
+	z_stream zs;                        // zlib state for the compressed image data
+	uint8_t *straight;                  // the current scanline, converted to straight alpha
+	uint8_t *prev;                      // the previous unfiltered scanline
+	uint8_t *filtered;                  // buffer holding the filtered scanline and its filter type
+	uint8_t *trial;                     // scratch buffer used to choose a filter type
+	uint8_t out[PNG_CHUNK_BYTES];       // buffer for compressed data awaiting an IDAT chunk
+} png_stream;
+
 
 /* create an image struct
  *   width, height: pixel dimensions of the image
  */
 image *create_image(const uint32_t width, const uint32_t height);
 
-/* load an image struct from a PNG file
+/* load an image struct from a PNG file, premultiplying its colours; return NULL if it can't
+ * be decoded
  *   imgpath: path to the image file
  */
 image *load_image(const char *imgpath);
 
-/* save an image struct to a PNG file
+/* save an image struct to a PNG file, converting its colours back to straight alpha
  *   img:     pointer to the image struct
  *   imgpath: path to the output file
  */
 void save_image(const image *img, const char *imgpath);
 
+/* open a PNG file for writing and return a stream struct (or NULL on error)
+ *   imgpath:       path to the output file
+ *   width, height: pixel dimensions of the image
+ */
+png_stream *open_png_stream(const char *imgpath, const uint32_t width, const uint32_t height);
+
+/* convert a number of premultiplied RGBA scanlines to straight alpha, then compress them and
+ * write them to a PNG stream
+ *   png:  pointer to the stream struct
+ *   data: pointer to a premultiplied RGBA pixel buffer, one image width per scanline
+ *   rows: number of scanlines to write
+ */
+void write_png_rows(png_stream *png, const uint8_t *data, const uint32_t rows);
+
+/* finish writing a PNG stream, close the file and free the stream struct; return false if any
+ * of the image could not be compressed or written
+ *   png: pointer to the stream struct
+ */
+bool close_png_stream(png_stream *png);
+
 /* free the memory used for an image struct
  *   img: pointer to the image struct
  */
@@ -67,5 +130,22 @@ image *scale_image_half(const image *img);
  */
 void slice_image(const image *img, const uint32_t tilesize, const char *tiledir);
 
+/* create a raster struct with every value set to zero
+ *   width, height: pixel dimensions of the raster
+ */
+raster *create_raster(const uint32_t width, const uint32_t height);
+
+/* save a raster struct as a 16-bit grayscale PNG file if the path ends in .png, or otherwise as
+ * a raw file of little-endian 16-bit values, one row after another
+ *   ras:     pointer to the raster struct
+ *   raspath: path to the output file
+ */
+void save_raster(const raster *ras, const char *raspath);
+
+/* free the memory used for a raster struct
+ *   ras: pointer to the raster struct
+ */
+void free_raster(raster *ras);
+
 
 #endif
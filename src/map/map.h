@@ -36,6 +36,8 @@
 #define HSHADE_HEIGHT 0.3 // height below which to add shadows
 #define HSHADE_AMOUNT 0.7 // amount of shadow to add
 #define NIGHT_AMBIENCE 0.2 // base light level for dark renders
+#define MAX_ZOOM CHUNK_BLOCK_BITS // most times the resolution can be halved: one pixel per chunk
+#define MAX_BLEND_RADIUS 7 // widest biome blend, whose sums of colours still fit in 16 bits
 
 #define HSHADE_BLOCK_HEIGHT (HSHADE_HEIGHT * MAX_HEIGHT)
 
@@ -46,6 +48,14 @@
 #define MAX_LIGHT (LIGHT_LEVELS - 1)
 
 
+// isometric occlusion culling: cells are 4x4 pixels, and tiles are 16x16 cells
+
+#define COVERAGE_CELL_BITS 2
+#define COVERAGE_CELL_SIZE (1 << COVERAGE_CELL_BITS)
+#define COVERAGE_TILE_BITS 4
+#define COVERAGE_TILE_SIZE (1 << COVERAGE_TILE_BITS)
+
+
 // min/max macros
 
 #define MIN(x, y) ({ \
@@ -59,6 +69,21 @@
 	_x > _y ? _x : _y; })
 
 
+// types of data that can be written to a raster aligned with an orthographic map
+typedef enum
+{
+	RASTER_NONE,
+	RASTER_HEIGHT, // the height of the top block of each column, plus one
+	RASTER_BIOME,  // the biome id of each column with a top block
+	RASTER_LIGHT   // the block light level just above the top block of each column
+}
+raster_type;
+
+// the colours of a biome as they are added up when blending: foliage RGB, grass RGB, and a weight
+// of one if the biome is known
+#define BLEND_LANES 8
+typedef uint16_t blend_colour[BLEND_LANES];
+
 // options for rendering the map
 typedef struct options
 {
@@ -70,37 +95,168 @@ typedef struct options
 		nether,       // whether to render the nether dimension (overrides options.end)
 		end;          // whether to render the end dimension
 	uint8_t rotate;   // how many times to rotate the map 90 degrees clockwise
+	uint8_t zoom;     // how many times to halve the resolution of an orthographic map, drawing
+	                  //   one column from each square of columns
+	uint8_t raster;   // the type of data to write to a raster instead of drawing an orthographic
+	                  //   map, or RASTER_NONE
+	uint8_t blend;    // radius in blocks of the square of columns to blend biome colours over,
+	                  //   or 0 to give each column its own biome's colours
 	int32_t *limits;  // pointer to an array of absolute min/max x/z block coords to crop to
 	                  //   (ymin, xmax, ymax, xmin)
 	uint8_t *ylimits; // pointer to an array of absolute min/max y coords to crop to
 	char *texpath,    // path to a block texture/colour CSV file
 		*shapepath,   // path to an isometric blocktype shape file
-		*biomepath;   // path to a biome colour CSV file
+		*biomepath,   // path to a biome colour CSV file
+		*mappath,     // path to a CSV file listing the resource pack textures for each block type
+		*packpath,    // path to a compiled texture pack to load instead of the CSV files, or NULL
+		*respath;     // path to a resource pack to take block colours from, or NULL
 }
 options;
 
+// a record of which parts of an image are already fully opaque, so that anything drawn behind
+// them can be skipped
+typedef struct coverage
+{
+	uint32_t pwidth, pheight; // dimensions of the image in pixels
+	uint32_t width, height;   // dimensions of the image in cells
+	uint32_t stride;          // number of 64-bit words in each row of the cell bitmap
+	uint32_t twidth, theight; // dimensions of the image in tiles
+	uint32_t pstride;         // number of bytes in each row of the pixel bitmap
+	uint64_t *cells;          // bitmap with a bit set for each cell whose pixels are all opaque
+	uint16_t *tiles;          // number of opaque cells in each tile
+	uint8_t *pixels;          // bitmap with a bit set for each opaque pixel, kept up to date as
+	                          //   isometric blocks are drawn
+}
+coverage;
+
 
-/* render a single column of blocks to an isometric map
- *   img:      pointer to the map's image struct
- *   px, py:   pixel coords of the top left corner of the column
+// one of several maps rendered from the same chunk data, with what's needed to draw onto it
+typedef struct map_target
+{
+	image *img;          // pointer to the map's image struct
+	raster *ras;         // pointer to the raster struct to write instead of an image, or NULL
+	coverage *cov;       // pointer to the image's coverage struct, or NULL to draw every chunk
+	int32_t rpx, rpy;    // pixel coords of the top left corner of the current region
+	const textures *tex; // pointer to the texture struct for this map's options
+	const options *opts; // pointer to this map's render options struct
+}
+map_target;
+
+
+// get the opaque bits for a row of four pixels, with the leftmost pixel in the lowest bit
+static inline uint8_t get_opaque_pixels(const coverage *cov, const uint32_t x, const uint32_t y)
+{
+	const uint8_t *p = &cov->pixels[y * cov->pstride + (x >> 3)];
+	return ((p[0] | p[1] << 8) >> (x & 7)) & 0xf;
+}
+
+// mark a pixel as opaque in the pixel bitmap
+static inline void set_opaque_pixel(coverage *cov, const uint32_t x, const uint32_t y)
+{
+	cov->pixels[y * cov->pstride + (x >> 3)] |= 1 << (x & 7);
+}
+
+// mark a row of four pixels as opaque in the pixel bitmap, given a bitmask of the opaque ones
+static inline void set_opaque_pixels(coverage *cov, const uint32_t x, const uint32_t y,
+		const uint8_t bits)
+{
+	uint8_t *p = &cov->pixels[y * cov->pstride + (x >> 3)];
+	uint16_t shifted = bits << (x & 7);
+	p[0] |= shifted;
+	p[1] |= shifted >> 8;
+}
+
+// check whether a strip of four pixels is opaque in every row of a range
+// rows outside the image can't be drawn, so they count as covered, but a strip that is partly
+// outside the image on either side never does
+static inline bool pixels_covered(const coverage *cov, const int32_t x, const int32_t y,
+		const uint32_t h)
+{
+	if (x < 0 || x + 4 > cov->width << COVERAGE_CELL_BITS) return 0;
+
+	int32_t y1 = MIN((int64_t)y + h, (int64_t)cov->pheight);
+	for (int32_t py = MAX(y, 0); py < y1; py++)
+		if (get_opaque_pixels(cov, x, py) != 0xf) return 0;
+	return 1;
+}
+
+
+/* build the lookup tables used to shade colours by height and light level
+ */
+void init_shading_tables(void);
+
+/* create an empty coverage struct for an image
+ *   img: pointer to the image struct
+ */
+coverage *create_coverage(const image *img);
+
+/* mark every cell and pixel of a coverage struct as not yet covered
+ *   cov: pointer to the coverage struct
+ */
+void clear_coverage(coverage *cov);
+
+/* free the memory used for a coverage struct
+ *   cov: pointer to the coverage struct
+ */
+void free_coverage(coverage *cov);
+
+/* mark the cells overlapping a rectangle of the image whose pixels have all become opaque
+ *   cov:  pointer to the coverage struct
+ *   x, y: pixel coords of the top left corner of the rectangle
+ *   w, h: pixel dimensions of the rectangle
+ */
+void update_coverage(coverage *cov, const int32_t x, const int32_t y, const uint32_t w,
+		const uint32_t h);
+
+/* check whether every cell overlapping a rectangle of the image is fully opaque
+ *   cov:  pointer to the coverage struct
+ *   x, y: pixel coords of the top left corner of the rectangle
+ *   w, h: pixel dimensions of the rectangle
+ */
+bool is_covered(const coverage *cov, const int32_t x, const int32_t y, const uint32_t w,
+		const uint32_t h);
+
+/* fill a table with the blend colours of every possible biome id
+ *   colours: output array of 256 blend colours
+ *   tex:     pointer to a texture struct with biomes
+ */
+void get_blend_colours(blend_colour *colours, const textures *tex);
+
+/* blend the biome colours of each column of a chunk with those of the columns around it, using
+ * a box filter that reaches into the neighbouring chunks, and store them in the chunk's tints
+ *   chunk:   pointer to the chunk data struct, stored in column order with biomes
+ *   nchunks: array of pointers to the 4 rotated neighbouring chunks, or NULL where absent
+ *   colours: array of 256 blend colours, from get_blend_colours
+ *   radius:  blend radius in blocks, up to MAX_BLEND_RADIUS
+ */
+void blend_chunk_biomes(chunk_data *chunk, chunk_data *nchunks[4], const blend_colour *colours,
+		const uint8_t radius);
+
+/* write the data for each column of an orthographic chunk with a top block to a raster
+ *   ras:      pointer to the raster struct
+ *   cpx, cpy: pixel coords of the top left corner of the chunk
  *   tex:      pointer to the texture struct
  *   chunk:    pointer to the chunk data struct
- *   rbx, rbz: the column's rotated chunk-level x/z coords
- *   opts:     pointer to the render options struct
+ *   opts:     pointer to the render options struct, giving the type of data
  */
-void render_iso_column(image *img, const int32_t px, const int32_t py, const textures *tex,
-		chunk_data *chunk, const uint8_t rbx, const uint8_t rbz, const options *opts);
+void write_chunk_raster(raster *ras, const int32_t cpx, const int32_t cpy, const textures *tex,
+		chunk_data *chunk, const options *opts);
 
-/* render a single column of blocks to an orthographic map
+/* render all the columns of a chunk onto the map
  *   img:      pointer to the map's image struct
- *   px, py:   pixel coords of the top left corner of the column
+ *   cov:      pointer to the map's coverage struct, or NULL to draw every column
+ *   cpx, cpy: pixel coords of the top left corner of the chunk
  *   tex:      pointer to the texture struct
  *   chunk:    pointer to the chunk data struct
- *   rbx, rbz: the column's rotated chunk-level x/z coords
  *   opts:     pointer to the render options struct
  */
-void render_ortho_column(image *img, const int32_t px, const int32_t py, const textures *tex,
-		chunk_data *chunk, const uint32_t rbx, const uint32_t rbz, const options *opts);
+typedef void (*chunk_renderer)(image *img, coverage *cov, const int32_t cpx,
+		const int32_t cpy, const textures *tex, chunk_data *chunk, const options *opts);
+
+/* get the chunk renderer specialized for the projection and rotate value of this render
+ *   opts: pointer to the render options struct
+ */
+chunk_renderer get_chunk_renderer(const options *opts);
 
 /* get the width of empty space that would be on each edge of the rendered map for this region
  *   margins:   pointer to the output array of pixel values for each edge
@@ -122,14 +278,26 @@ void render_tiny_region_map(image *img, const int32_t rpx, const int32_t rpy, re
 
 /* render a full region onto the map
  *   img:      pointer to the image struct
+ *   cov:      pointer to the image's coverage struct, or NULL to draw every chunk
  *   rpx, rpy: pixel coords of the top left corner of this region
  *   reg:      pointer to the region struct
  *   nregions: array of pointers to the rotated neighbouring region structs
  *   tex:      pointer to the texture struct
  *   opts:     pointer to the render options struct
  */
-void render_region_map(image *img, const int32_t rpx, const int32_t rpy, region *reg,
-		region *nregions[4], const textures *tex, const options *opts);
+void render_region_map(image *img, coverage *cov, const int32_t rpx, const int32_t rpy,
+		region *reg, region *nregions[4], const textures *tex, const options *opts);
+
+/* render a full region onto several maps at once, reading each chunk only once
+ *   targets:  array of map targets; isometric maps must have the region's rotate value, but
+ *             orthographic maps can have any, and each map can have its own y limits
+ *   count:    number of map targets
+ *   reg:      pointer to the region struct
+ *   nregions: array of pointers to the rotated neighbouring region structs
+ *   rotate:   the rotate value that the region and its neighbours are arranged by
+ */
+void render_region_maps(map_target *targets, const uint16_t count, region *reg,
+		region *nregions[4], const uint8_t rotate);
 
 /* render the full world onto the map
  *   img:      pointer to the image struct
@@ -140,6 +308,20 @@ void render_region_map(image *img, const int32_t rpx, const int32_t rpy, region
 void render_world_map(image *img, int32_t wpx, int32_t wpy, const worldinfo *world,
 		const options *opts);
 
+/* render the full world onto several maps at once, reading each chunk only once
+ *   imgs:     array of pointers to the image structs
+ *   rasters:  array of pointers to the raster structs of maps that write one instead of an
+ *             image, or NULL if none do
+ *   wpx, wpy: arrays of pixel coords of the top left corner of the world on each map
+ *   count:    number of maps
+ *   world:    pointer to the world struct
+ *   opts:     array of render options structs, one for each map; isometric and tiny maps must
+ *             have the world's rotate value, but orthographic maps can have any, and each map
+ *             can have its own y limits
+ */
+void render_world_maps(image **imgs, raster **rasters, const int32_t *wpx, const int32_t *wpy,
+		const uint16_t count, const worldinfo *world, const options *opts);
+
 /* render a map from a world directory and return a pointer to an image struct
  *   worldpath: path to the world directory
  *   imgpath:   path to the output image file
@@ -147,5 +329,28 @@ void render_world_map(image *img, int32_t wpx, int32_t wpy, const worldinfo *wor
  */
 image *create_world_map(char *worldpath, const options *opts);
 
+/* render several maps of a world directory, storing a pointer to an image struct for each one,
+ * and return false if the world couldn't be read; orthographic maps are all rendered in a single
+ * pass, but isometric maps need another pass for each rotate value after the first
+ *   imgs:      pointer to the output array of image struct pointers, which are NULL for maps
+ *              that write a raster instead
+ *   rasters:   pointer to the output array of raster struct pointers, which are NULL for maps
+ *              that draw an image, or NULL if no map writes a raster
+ *   worldpath: path to the world directory
+ *   opts:      array of render options structs, one for each map, which must share the world
+ *              options (limits, dimension)
+ *   count:     number of maps
+ */
+bool create_world_maps(image **imgs, raster **rasters, char *worldpath, const options *opts,
+		const uint16_t count);
+
+/* render a map from a world directory one band at a time, writing each band to a PNG file
+ *   as soon as it is finished, so that the whole image is never held in memory
+ *   worldpath: path to the world directory
+ *   imgpath:   path to the output image file
+ *   opts:      pointer to a render options struct
+ */
+bool stream_world_map(char *worldpath, const char *imgpath, const options *opts);
+
 
 #endif
@@ -102,39 +102,153 @@ void render_tiny_region_map(image *img, const int32_t rpx, const int32_t rpy, re
 }
 
 
-void render_region_map(image *img, const int32_t rpx, const int32_t rpy, region *reg,
-		region *nregions[4], const textures *tex, const options *opts)
+// check whether everything an isometric chunk could draw within the y limits is already covered,
+// testing one strip for each pair of pixel columns across the chunk's footprint
+static bool chunk_is_covered(const coverage *cov, const int32_t cpx, const int32_t cpy,
+		const uint8_t ymin, const uint8_t ymax)
+{
+	for (uint8_t s = 0; s < CHUNK_BLOCK_LENGTH * 2 - 1; s++)
+	{
+		// the strip's distance from the centre of the chunk, in blocks
+		uint8_t edge = abs(s - MAX_CHUNK_BLOCK);
+
+		int32_t top = cpy + edge * ISO_BLOCK_TOP_HEIGHT + (MAX_HEIGHT - ymax) * ISO_BLOCK_DEPTH;
+		int32_t bottom = cpy + (MAX_CHUNK_BLOCK * 2 - edge) * ISO_BLOCK_TOP_HEIGHT
+				+ (MAX_HEIGHT - ymin) * ISO_BLOCK_DEPTH + ISO_BLOCK_HEIGHT;
+		if (!is_covered(cov, cpx + s * ISO_BLOCK_X_MARGIN, top, ISO_BLOCK_WIDTH, bottom - top))
+			return 0;
+	}
+	return 1;
+}
+
+
+// get the pixel coords of a chunk's top left corner on a map, from its coords in a region
+// arranged by the given rotate value
+static void get_chunk_coords(int32_t *cpx, int32_t *cpy, const map_target *target,
+		const int8_t rcx, const int8_t rcz, const uint8_t rotate)
+{
+	if (target->opts->isometric)
+	{
+		// translate orthographic to isometric coordinates
+		*cpx = target->rpx + (rcx + MAX_REGION_CHUNK - rcz) * ISO_CHUNK_X_MARGIN;
+		*cpy = target->rpy + (rcx + rcz) * ISO_CHUNK_Y_MARGIN;
+	}
+	else
+	{
+		// turn the chunk the rest of the way to the map's own rotation
+		uint32_t mcx = rcx, mcz = rcz;
+		rotate_coords(&mcx, &mcz, REGION_CHUNK_LENGTH, REGION_CHUNK_LENGTH,
+				target->opts->rotate - rotate);
+		*cpx = target->rpx + (mcx * CHUNK_BLOCK_LENGTH >> target->opts->zoom);
+		*cpy = target->rpy + (mcz * CHUNK_BLOCK_LENGTH >> target->opts->zoom);
+	}
+}
+
+
+void render_region_map(image *img, coverage *cov, const int32_t rpx, const int32_t rpy,
+		region *reg, region *nregions[4], const textures *tex, const options *opts)
+{
+	map_target target = {img, NULL, cov, rpx, rpy, tex, opts};
+	render_region_maps(&target, 1, reg, nregions, opts->rotate);
+}
+
+
+// get the y limits a map's chunks are drawn within, or the full height of the world
+static void get_target_ylimits(uint8_t ylimits[2], const options *opts)
+{
+	ylimits[0] = opts->ylimits != NULL ? opts->ylimits[0] : 0;
+	ylimits[1] = opts->ylimits != NULL ? opts->ylimits[1] : MAX_HEIGHT;
+}
+
+
+void render_region_maps(map_target *targets, const uint16_t count, region *reg,
+		region *nregions[4], const uint8_t rotate)
 {
 	open_region_file(reg);
 	if (reg == NULL || reg->file == NULL) return;
 
 	for (uint8_t i = 0; i < 4; i++) open_region_file(nregions[i]);
 
+	// load the data that any of the maps need, within the y limits of all of them
+	chunk_flags flags = {1, 1, 0, 0, 0, 1};
+	chunk_flags nflags = {1, 0, 0, 0, 0, 1};
+	chunk_renderer renderers[count];
+	uint8_t tylimits[count][2], ylimits[2] = {MAX_HEIGHT, 0};
+	uint16_t tsections[count];
+	const textures *blendtex = NULL;
+	uint8_t blend = 0;
+	for (uint16_t t = 0; t < count; t++)
+	{
+		const options *opts = targets[t].opts;
+		renderers[t] = get_chunk_renderer(opts);
+
+		// biome colours are blended once for every map, over the widest radius any of them use
+		if (opts->biomes && opts->blend > blend)
+		{
+			blend = opts->blend;
+			blendtex = targets[t].tex;
+		}
+
+		flags.blight |= opts->dark || opts->raster == RASTER_LIGHT;
+		flags.slight |= opts->isometric && !opts->dark && opts->shadows;
+		flags.biomes |= opts->biomes || opts->raster == RASTER_BIOME;
+		nflags.bdata |= opts->isometric;
+		nflags.blight |= opts->isometric && opts->dark;
+		nflags.slight |= opts->isometric && !opts->dark && opts->shadows;
+		nflags.biomes |= opts->biomes && opts->blend;
+
+		get_target_ylimits(tylimits[t], opts);
+		ylimits[0] = MIN(ylimits[0], tylimits[t][0]);
+		ylimits[1] = MAX(ylimits[1], tylimits[t][1]);
+
+		// the sections a chunk must have for anything to be drawn within the map's y limits
+		tsections[t] = (2 << tylimits[t][1] / SECTION_BLOCK_HEIGHT) -
+				(1 << tylimits[t][0] / SECTION_BLOCK_HEIGHT);
+	}
+	blend_colour blendcolours[256];
+	if (blend) get_blend_colours(blendcolours, blendtex);
+	const uint8_t *rylimits = ylimits[0] > 0 || ylimits[1] < MAX_HEIGHT ? ylimits : NULL;
+
+	// maps with narrower y limits than the chunks are read with each get a slice of them, whose
+	// arrays are reused from chunk to chunk
+	chunk_data *slices[count];
+	memset(slices, 0, sizeof(slices));
+
 	chunk_data *chunk, *prev_chunk, *new_chunk, *nchunks[4];
-	chunk_flags flags = {
-		1,
-		1,
-		opts->dark,
-		opts->isometric && !opts->dark && opts->shadows,
-		opts->biomes
-	};
-	chunk_flags nflags = {
-		1,
-		opts->isometric,
-		opts->isometric && opts->dark,
-		opts->isometric && !opts->dark && opts->shadows,
-		0
-	};
 
 	// use rotated chunk coordinates, since we need to draw them from bottom to top for isometric
 	for (int8_t rcz = MAX_REGION_CHUNK; rcz >= 0; rcz--)
 	{
 		for (int8_t rcx = MAX_REGION_CHUNK; rcx >= 0; rcx--)
 		{
+			// get chunk pixel coords on each map, and find the maps it would be hidden on
+			int32_t cpx[count], cpy[count];
+			bool covered[count], visible = 0;
+			for (uint16_t t = 0; t < count; t++)
+			{
+				get_chunk_coords(&cpx[t], &cpy[t], &targets[t], rcx, rcz, rotate);
+				covered[t] = targets[t].cov != NULL && chunk_is_covered(targets[t].cov,
+						cpx[t], cpy[t], tylimits[t][0], tylimits[t][1]);
+				if (!covered[t]) visible = 1;
+			}
+
+			// skip reading chunks that would be hidden behind what's already been drawn
+			// the next chunk will have to read this one itself if it needs it as a neighbour
+			if (!visible)
+			{
+				if (rcx < MAX_REGION_CHUNK && prev_chunk != NULL)
+				{
+					free_chunk(new_chunk);
+					free_chunk(prev_chunk);
+				}
+				prev_chunk = NULL;
+				continue;
+			}
+
 			// get the actual chunk from its rotated coordinates
 			// use the "new" chunk saved by the previous iteration if possible
 			chunk = rcx < MAX_REGION_CHUNK && prev_chunk != NULL ? new_chunk :
-					read_chunk(reg, rcx, rcz, opts->rotate, &flags, opts->ylimits);
+					read_chunk(reg, rcx, rcz, rotate, &flags, rylimits);
 			if (chunk == NULL)
 			{
 				if (rcx < MAX_REGION_CHUNK) free_chunk(prev_chunk);
@@ -144,67 +258,56 @@ void render_region_map(image *img, const int32_t rpx, const int32_t rpy, region
 
 			// get neighbouring chunks, either from this region or a neighbouring one
 			nchunks[TOP] = rcz > 0 ?
-					read_chunk(reg, rcx, rcz - 1, opts->rotate, &flags, opts->ylimits) :
-					read_chunk(nregions[TOP], rcx, MAX_REGION_CHUNK, opts->rotate, &nflags,
-							opts->ylimits);
+					read_chunk(reg, rcx, rcz - 1, rotate, &flags, rylimits) :
+					read_chunk(nregions[TOP], rcx, MAX_REGION_CHUNK, rotate, &nflags, rylimits);
 
-			nchunks[RIGHT] = rcx < MAX_REGION_CHUNK ? prev_chunk :
-					read_chunk(nregions[RIGHT], 0, rcz, opts->rotate, &nflags, opts->ylimits);
+			nchunks[RIGHT] = rcx < MAX_REGION_CHUNK ? (prev_chunk != NULL ? prev_chunk :
+					read_chunk(reg, rcx + 1, rcz, rotate, &flags, rylimits)) :
+					read_chunk(nregions[RIGHT], 0, rcz, rotate, &nflags, rylimits);
 
 			nchunks[BOTTOM] = rcz < MAX_REGION_CHUNK ?
-					read_chunk(reg, rcx, rcz + 1, opts->rotate, &flags, opts->ylimits) :
-					read_chunk(nregions[BOTTOM], rcx, 0, opts->rotate, &nflags, opts->ylimits);
+					read_chunk(reg, rcx, rcz + 1, rotate, &flags, rylimits) :
+					read_chunk(nregions[BOTTOM], rcx, 0, rotate, &nflags, rylimits);
 
 			nchunks[LEFT] = rcx > 0 ?
-					read_chunk(reg, rcx - 1, rcz, opts->rotate, &flags, opts->ylimits) :
-					read_chunk(nregions[LEFT], MAX_REGION_CHUNK, rcz, opts->rotate, &nflags,
-							opts->ylimits);
+					read_chunk(reg, rcx - 1, rcz, rotate, &flags, rylimits) :
+					read_chunk(nregions[LEFT], MAX_REGION_CHUNK, rcz, rotate, &nflags, rylimits);
 
-			for (uint8_t i = 0; i < 4; i++)
-			{
-				if (nchunks[i] == NULL)
-				{
-					chunk->nbids[i] = NULL;
-					chunk->nbdata[i] = NULL;
-					chunk->nblight[i] = NULL;
-					chunk->nslight[i] = NULL;
-				}
-				else {
-					chunk->nbids[i] = nchunks[i]->bids;
-					chunk->nbdata[i] = nchunks[i]->bdata;
-					chunk->nblight[i] = nchunks[i]->blight;
-					chunk->nslight[i] = nchunks[i]->slight;
-				}
-			}
+			copy_chunk_halo(chunk, nchunks);
+			if (blend) blend_chunk_biomes(chunk, nchunks, blendcolours, blend);
 
-			// render chunk image onto region image
-			uint32_t cpx, cpy;
-			if (opts->isometric)
-			{
-				// translate orthographic to isometric coordinates
-				cpx = rpx + (rcx + MAX_REGION_CHUNK - rcz) * ISO_CHUNK_X_MARGIN;
-				cpy = rpy + (rcx + rcz) * ISO_CHUNK_Y_MARGIN;
-			}
-			else
+			// render chunk image onto each region image it isn't hidden on, and record which
+			// parts of them are now opaque; maps with another rotate value get a copy of the
+			// chunk turned the rest of the way, which is much cheaper than reading it again
+			chunk_data *rchunks[4] = {chunk};
+			for (uint16_t t = 0; t < count; t++)
 			{
-				cpx = rpx + rcx * CHUNK_BLOCK_LENGTH;
-				cpy = rpy + rcz * CHUNK_BLOCK_LENGTH;
+				// a chunk with no sections within the map's y limits has nothing to draw
+				if (covered[t] || !(chunk->sections & tsections[t])) continue;
+				map_target *target = &targets[t];
+				uint8_t r = (uint8_t)(target->opts->rotate - rotate) % 4;
+				if (rchunks[r] == NULL) rchunks[r] = rotate_chunk(chunk, r);
+
+				chunk_data *tchunk = rchunks[r];
+				if (tylimits[t][0] > ylimits[0] || tylimits[t][1] < ylimits[1])
+					tchunk = slices[t] = slice_chunk(slices[t], rchunks[r], tylimits[t]);
+
+				if (target->ras != NULL)
+					write_chunk_raster(target->ras, cpx[t], cpy[t], target->tex, tchunk,
+							target->opts);
+				else
+					renderers[t](target->img, target->cov, cpx[t], cpy[t], target->tex, tchunk,
+							target->opts);
+				if (target->cov != NULL)
+					update_coverage(target->cov, cpx[t],
+							cpy[t] + (MAX_HEIGHT - tylimits[t][1]) * ISO_BLOCK_DEPTH,
+							ISO_CHUNK_WIDTH,
+							ISO_CHUNK_TOP_HEIGHT + (tylimits[t][1] - tylimits[t][0] + 1) *
+							ISO_BLOCK_DEPTH);
 			}
 
-			// loop through rotated chunk's blocks
-			for (int16_t rbz = MAX_CHUNK_BLOCK; rbz >= 0; rbz--)
-				for (int16_t rbx = MAX_CHUNK_BLOCK; rbx >= 0; rbx--)
-					if (opts->isometric)
-					{
-						// translate orthographic to isometric coordinates
-						uint32_t px = cpx + (rbx + MAX_CHUNK_BLOCK - rbz) * ISO_BLOCK_WIDTH / 2;
-						uint32_t py = cpy + (rbx + rbz) * ISO_BLOCK_TOP_HEIGHT;
-						render_iso_column(img, px, py, tex, chunk, rbx, rbz, opts);
-					}
-					else
-						render_ortho_column(img, cpx + rbx, cpy + rbz, tex, chunk, rbx, rbz, opts);
-
 			// free chunks, or save them for the next iteration if we're not at the end of a row
+			for (uint8_t r = 1; r < 4; r++) free_chunk(rchunks[r]);
 			free_chunk(nchunks[TOP]);
 			free_chunk(nchunks[RIGHT]);
 			free_chunk(nchunks[BOTTOM]);
@@ -221,6 +324,8 @@ void render_region_map(image *img, const int32_t rpx, const int32_t rpy, region
 		}
 	}
 
+	for (uint16_t t = 0; t < count; t++) free_chunk(slices[t]);
+
 	close_region_file(reg);
 	for (uint8_t i = 0; i < 4; i++) close_region_file(nregions[i]);
 }
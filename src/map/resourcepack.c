@@ -0,0 +1,331 @@
+/*
+	cmapbash - a simple Minecraft map renderer written in C.
+	© 2014 saltire sable, x@saltiresable.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _XOPEN_SOURCE 500 // for stat
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+#include "map.h"
+#include "textures.h"
+
+
+#define LINE_BUFFER 200
+#define NAME_LENGTH 64
+
+#define TEXTURE_DIR "assets/minecraft/textures/blocks/"
+#define CACHE_NAME "cmapbash-colours.cache"
+#define CACHE_MAGIC "cmapbcol"
+#define CACHE_VERSION 1
+
+// pixels whose channels can be summed in 32-bit lanes without overflowing
+#define SUM_BLOCK_PIXELS 65536
+
+
+typedef enum
+{
+	MAP_BLOCKID,
+	MAP_SUBTYPE,
+	MAP_TEXTURE1,
+	MAP_TEXTURE2,
+	MAP_TINT,
+	MAPCOL_COUNT
+}
+mapcolumns;
+
+// the textures listed for a block id and subtype, or for every subtype of a block id
+typedef struct texture_entry
+{
+	uint8_t blockid;
+	int8_t subtype;                  // subtype, or -1 for every subtype
+	char names[2][NAME_LENGTH];      // textures to average for colours 1 and 2, or empty strings
+	uint8_t tint[CHANNELS];          // colour to multiply colour 1 by, for greyscale textures that
+	                                 //   the game tints
+}
+texture_entry;
+
+// header at the start of a cache file, followed by a resource colours struct
+typedef struct cache_header
+{
+	char magic[8];    // CACHE_MAGIC, without the terminating null
+	uint32_t version; // CACHE_VERSION of the build that wrote the cache
+	uint32_t size;    // size of a resource colours struct in the build that wrote the cache
+	uint64_t hash;    // hash of the texture list and the textures it names
+}
+cache_header;
+
+
+// split a line of a CSV file into fields in place, filling any missing fields with empty strings
+static void split_csv_line(char **fields, const uint8_t count, char *line)
+{
+	line[strcspn(line, "\r\n")] = '\0';
+	uint8_t f = 0;
+	char *pos = line;
+	while (f < count)
+	{
+		fields[f++] = pos;
+		pos += strcspn(pos, ",");
+		if (*pos == '\0') break;
+		*pos++ = '\0';
+	}
+	while (f < count) fields[f++] = pos;
+}
+
+
+// read the list of textures for each block type
+static texture_entry *read_texture_map(uint16_t *count, const char *mappath)
+{
+	FILE *csv = fopen(mappath, "r");
+	if (csv == NULL)
+	{
+		fprintf(stderr, "Error %d reading texture list: %s\n", errno, mappath);
+		return NULL;
+	}
+
+	char line[LINE_BUFFER];
+	*count = 0;
+	while (fgets(line, LINE_BUFFER, csv)) (*count)++;
+	texture_entry *entries = (texture_entry*)calloc(*count, sizeof(texture_entry));
+
+	fseek(csv, 0, SEEK_SET);
+	uint16_t e = 0;
+	while (e < *count && fgets(line, LINE_BUFFER, csv))
+	{
+		char *fields[MAPCOL_COUNT];
+		split_csv_line(fields, MAPCOL_COUNT, line);
+		if (!strcmp(fields[MAP_BLOCKID], "")) continue;
+
+		texture_entry *entry = &entries[e++];
+		entry->blockid = (uint8_t)strtol(fields[MAP_BLOCKID], NULL, 0);
+		entry->subtype = strcmp(fields[MAP_SUBTYPE], "") ?
+				(int8_t)strtol(fields[MAP_SUBTYPE], NULL, 0) % BLOCK_SUBTYPES : -1;
+		for (uint8_t c = 0; c < 2; c++)
+			snprintf(entry->names[c], NAME_LENGTH, "%s", fields[MAP_TEXTURE1 + c]);
+
+		// tints are hex RGB colours
+		uint32_t tint = strcmp(fields[MAP_TINT], "") ?
+				strtol(fields[MAP_TINT], NULL, 16) : 0xffffff;
+		for (uint8_t ch = 0; ch < ALPHA; ch++) entry->tint[ch] = tint >> ((2 - ch) * 8);
+		entry->tint[ALPHA] = 255;
+	}
+	*count = e;
+	fclose(csv);
+	return entries;
+}
+
+
+// add some bytes to an FNV-1a hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, const size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+
+// hash the texture list along with the size and modification time of every texture it names,
+// which changes whenever the pack does without having to decode any of its images
+static uint64_t hash_resource_pack(const char *respath, const texture_entry *entries,
+		const uint16_t count)
+{
+	uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, entries, count * sizeof(texture_entry));
+
+	char path[LINE_BUFFER * 2];
+	for (uint16_t e = 0; e < count; e++)
+		for (uint8_t c = 0; c < 2; c++)
+		{
+			if (entries[e].names[c][0] == '\0') continue;
+			snprintf(path, sizeof(path), "%s/" TEXTURE_DIR "%s.png", respath,
+					entries[e].names[c]);
+			struct stat st;
+			int64_t stamp[2] = {-1, -1};
+			if (!stat(path, &st))
+			{
+				stamp[0] = st.st_size;
+				stamp[1] = st.st_mtime;
+			}
+			hash = hash_bytes(hash, stamp, sizeof(stamp));
+		}
+	return hash;
+}
+
+
+// add up the premultiplied channels of every pixel in a texture, which weights each colour by its
+// alpha, and count the pixels that are neither fully transparent nor fully opaque
+static void sum_texture(uint64_t *sums, uint64_t *partial, const image *img)
+{
+	size_t count = (size_t)img->width * img->height, p = 0;
+	memset(sums, 0, CHANNELS * sizeof(uint64_t));
+	*partial = 0;
+
+#ifdef __SSE2__
+	// four pixels at a time, widening each channel to a 32-bit lane
+	const __m128i zero = _mm_setzero_si128(), alphas = _mm_set1_epi32(0xff000000);
+	while (p + 4 <= count)
+	{
+		__m128i acc = zero;
+		size_t end = MIN(count & ~(size_t)3, p + SUM_BLOCK_PIXELS);
+		for (; p < end; p += 4)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)&img->data[p * CHANNELS]);
+			__m128i pairs = _mm_add_epi16(_mm_unpacklo_epi8(pixels, zero),
+					_mm_unpackhi_epi8(pixels, zero));
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(pairs, zero),
+					_mm_unpackhi_epi16(pairs, zero)));
+
+			__m128i a = _mm_and_si128(pixels, alphas);
+			uint8_t ends = _mm_movemask_ps(_mm_castsi128_ps(
+					_mm_or_si128(_mm_cmpeq_epi32(a, zero), _mm_cmpeq_epi32(a, alphas))));
+			*partial += 4 - __builtin_popcount(ends);
+		}
+
+		uint32_t lanes[CHANNELS];
+		_mm_storeu_si128((__m128i*)lanes, acc);
+		for (uint8_t ch = 0; ch < CHANNELS; ch++) sums[ch] += lanes[ch];
+	}
+#endif
+
+	for (; p < count; p++)
+	{
+		const uint8_t *pixel = &img->data[p * CHANNELS];
+		for (uint8_t ch = 0; ch < CHANNELS; ch++) sums[ch] += pixel[ch];
+		if (pixel[ALPHA] > 0 && pixel[ALPHA] < 255) (*partial)++;
+	}
+}
+
+
+// get the average colour of a texture, weighted by alpha and multiplied by a tint, and whether
+// its alpha is worth using; return false if the texture is missing, unreadable or fully
+// transparent
+static bool get_texture_colour(uint8_t *colour, bool *translucent, const char *respath,
+		const char *name, const uint8_t *tint)
+{
+	char path[LINE_BUFFER * 2];
+	snprintf(path, sizeof(path), "%s/" TEXTURE_DIR "%s.png", respath, name);
+	struct stat st;
+	if (stat(path, &st)) return 0;
+
+	image *img = load_image(path);
+	if (img == NULL) return 0;
+	uint64_t sums[CHANNELS], partial;
+	sum_texture(sums, &partial, img);
+	size_t count = (size_t)img->width * img->height;
+	free_image(img);
+	if (sums[ALPHA] == 0) return 0;
+
+	// channels are premultiplied, so dividing by the total alpha gives the weighted average
+	for (uint8_t ch = 0; ch < ALPHA; ch++)
+		colour[ch] = (sums[ch] * 255 + sums[ALPHA] / 2) / sums[ALPHA] * tint[ch] / 255;
+	colour[ALPHA] = (sums[ALPHA] + count / 2) / count;
+
+	// the alpha of a texture whose pixels are all either transparent or opaque says how much of
+	// the block is cut out, which the shapes already handle, so only use it for translucent ones
+	*translucent = partial > 0;
+	return 1;
+}
+
+
+resource_colours *read_resource_colours(const char *respath, const char *mappath)
+{
+	uint16_t count;
+	texture_entry *entries = read_texture_map(&count, mappath);
+	if (entries == NULL) return NULL;
+
+	resource_colours *rescolours = (resource_colours*)calloc(1, sizeof(resource_colours));
+	uint64_t hash = hash_resource_pack(respath, entries, count);
+
+	// reuse the colours from the last run if the pack hasn't changed
+	char cachepath[LINE_BUFFER * 2];
+	snprintf(cachepath, sizeof(cachepath), "%s/" CACHE_NAME, respath);
+	FILE *cache = fopen(cachepath, "rb");
+	if (cache != NULL)
+	{
+		cache_header header;
+		bool hit = fread(&header, sizeof(header), 1, cache) == 1 &&
+				!memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) &&
+				header.version == CACHE_VERSION && header.size == sizeof(resource_colours) &&
+				header.hash == hash && fread(rescolours, sizeof(resource_colours), 1, cache) == 1;
+		fclose(cache);
+		if (hit)
+		{
+			free(entries);
+			return rescolours;
+		}
+		memset(rescolours, 0, sizeof(resource_colours));
+	}
+
+	static const uint8_t no_tint[CHANNELS] = {255, 255, 255, 255};
+	uint16_t missing = 0;
+	for (uint16_t e = 0; e < count; e++)
+		for (uint8_t c = 0; c < 2; c++)
+		{
+			const texture_entry *entry = &entries[e];
+			if (entry->names[c][0] == '\0') continue;
+
+			uint8_t colour[CHANNELS];
+			bool translucent;
+			if (!get_texture_colour(colour, &translucent, respath, entry->names[c],
+					c == 0 ? entry->tint : no_tint))
+			{
+				missing++;
+				continue;
+			}
+
+			// later entries replace earlier ones, so a block id's subtypes can override it
+			for (uint8_t s = 0; s < BLOCK_SUBTYPES; s++)
+			{
+				if (entry->subtype >= 0 && entry->subtype != s) continue;
+				uint8_t *flags = &rescolours->flags[entry->blockid][s];
+				*flags &= ~(RESOURCE_COLOUR(c) | RESOURCE_ALPHA(c));
+				*flags |= RESOURCE_COLOUR(c) | (translucent ? RESOURCE_ALPHA(c) : 0);
+				memcpy(rescolours->colours[entry->blockid][s][c], colour, CHANNELS);
+			}
+		}
+	if (missing)
+		fprintf(stderr, "%d textures were missing, unreadable or blank in resource pack %s; "
+				"using the CSV colours for them\n", missing, respath);
+	free(entries);
+
+	// the pack directory may not be writable, in which case the colours are just read each time
+	cache = fopen(cachepath, "wb");
+	if (cache != NULL)
+	{
+		cache_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+		header.version = CACHE_VERSION;
+		header.size = sizeof(resource_colours);
+		header.hash = hash;
+		fwrite(&header, sizeof(header), 1, cache);
+		fwrite(rescolours, sizeof(resource_colours), 1, cache);
+		fclose(cache);
+	}
+
+	return rescolours;
+}
@@ -17,12 +17,18 @@
 */
 
 
+#define _XOPEN_SOURCE 600 // for mmap and posix_memalign
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "image.h"
 #include "map.h"
@@ -31,6 +37,31 @@
 
 #define LINE_BUFFER 100
 
+#define PACK_MAGIC "cmapbtex"
+#define PACK_VERSION 4
+#define PACK_ALIGN 64
+
+
+// header at the start of a compiled texture pack file
+// a pack is only a cache of the CSV files, so it is written in the machine's native layout,
+// and refused by any build whose block id structs don't have the same size
+typedef struct pack_header
+{
+	char magic[8];             // PACK_MAGIC, without the terminating null
+	uint32_t version;          // PACK_VERSION of the build that wrote the pack
+	uint32_t blockid_size;     // size of a block id struct in the build that wrote the pack
+	uint32_t max_blockid;      // highest block id present in the pack
+	uint32_t biomecount;       // number of palettes in each block type's biome palettes
+	uint64_t blockids;         // offset of the block id structs, whose biome palette pointers
+	                           //   hold the offset of their palettes instead, or 0
+	uint64_t materials[2];     // offsets of the material tables without and with biome colours
+	uint64_t biome_colours;    // offset of the top colours in every biome
+	uint32_t biome_typecount;  // number of block types that biome colours apply to
+	uint64_t biomes;           // offset of the biome structs for each biome id
+	uint64_t size;             // size of the whole file
+}
+pack_header;
+
 
 typedef enum
 {
@@ -259,6 +290,120 @@ static void add_hilight_and_shadow(uint8_t *colour)
 }
 
 
+// pack a shape's pixel map into 4-bit colour codes, replacing the hilight and/or shadow with the
+// unshaded colour where that side of the block is blocked
+static uint64_t pack_pixmap(const shape *bshape, const uint8_t blocked)
+{
+	uint64_t pixmap = 0;
+	for (int8_t so = ISO_BLOCK_AREA - 1; so >= 0; so--)
+	{
+		uint8_t colour = bshape->pixmap[so];
+		if (blocked & HILIGHT_BLOCKED)
+		{
+			if (colour == HILIGHT1) colour = COLOUR1;
+			if (colour == HILIGHT2) colour = COLOUR2;
+		}
+		if (blocked & SHADOW_BLOCKED)
+		{
+			if (colour == SHADOW1) colour = COLOUR1;
+			if (colour == SHADOW2) colour = COLOUR2;
+		}
+		pixmap = pixmap << 4 | colour;
+	}
+	return pixmap;
+}
+
+
+// check whether every colour a shape uses is fully opaque in a palette
+static bool palette_is_opaque(const palette *bpalette, const shape *bshape)
+{
+	for (uint8_t c = COLOUR1; c < COLOUR_COUNT; c++)
+		if (bshape->clrcount[c] && (*bpalette)[c][ALPHA] < 255) return 0;
+	return 1;
+}
+
+
+// get the solid/opaque flags for each rotation of a block type's shape
+// blocks with biome colours are only opaque if they are opaque in every biome
+static uint8_t get_shape_flags(const blocktype *btype, const uint8_t biomecount)
+{
+	uint8_t flags = 0;
+	for (uint8_t r = 0; r < 4; r++)
+	{
+		const shape *bshape = &btype->shapes[r];
+		if (bshape->clrcount[BLANK]) continue;
+		flags |= SOLID_SHAPE(r);
+
+		if (!palette_is_opaque(&btype->palette, bshape)) continue;
+		bool opaque = 1;
+		if (btype->biome_palettes != NULL)
+			for (uint8_t b = 0; b < biomecount && opaque; b++)
+				opaque = palette_is_opaque(&btype->biome_palettes[b], bshape);
+		if (opaque) flags |= OPAQUE_SHAPE(r);
+	}
+	return flags;
+}
+
+
+// store the shape flags of every block id and data value in a material table
+static void fill_shape_flags(material *materials, const textures *tex, const uint8_t biomecount)
+{
+	for (int b = 0; b <= tex->max_blockid; b++)
+		if (tex->blockids[b].subtype_mask)
+			for (uint8_t d = 0; d < BLOCK_SUBTYPES; d++)
+				materials[b * BLOCK_SUBTYPES + d].shape_flags =
+						get_shape_flags(get_block_type(tex, b, d), biomecount);
+}
+
+
+// build the material table from the block types, collecting the top colours of the block types
+// with biome colours into one array; the table is aligned to a cache line
+static void fill_materials(textures *tex)
+{
+	uint32_t typecount = 0;
+	for (int b = 0; b <= tex->max_blockid; b++)
+		for (uint8_t s = 0; s < BLOCK_SUBTYPES; s++)
+			if (tex->blockids[b].subtypes[s].biome_palettes != NULL) typecount++;
+	tex->biome_colours = (uint8_t(*)[CHANNELS])calloc(typecount * tex->biomecount, CHANNELS);
+
+	const size_t matsize = (tex->max_blockid + 1) * BLOCK_SUBTYPES * sizeof(material);
+	void *materials = NULL;
+	if (posix_memalign(&materials, PACK_ALIGN, matsize) == 0) memset(materials, 0, matsize);
+	tex->materials = (material*)materials;
+	int16_t row = 0;
+	for (int b = 0; b <= tex->max_blockid; b++)
+	{
+		// copy each subtype's top colours once
+		int16_t biome_rows[BLOCK_SUBTYPES];
+		for (uint8_t s = 0; s < BLOCK_SUBTYPES; s++)
+		{
+			const blocktype *btype = &tex->blockids[b].subtypes[s];
+			biome_rows[s] = -1;
+			if (btype->biome_palettes == NULL) continue;
+			biome_rows[s] = row;
+			for (uint16_t i = 0; i < tex->biomecount; i++)
+				memcpy(tex->biome_colours[row * tex->biomecount + i],
+						btype->biome_palettes[i][COLOUR1], CHANNELS);
+			row++;
+		}
+
+		// block ids missing from the CSV file are left blank
+		uint8_t mask = tex->blockids[b].subtype_mask;
+		if (!mask) continue;
+		for (uint8_t d = 0; d < BLOCK_SUBTYPES; d++)
+		{
+			const blocktype *btype = &tex->blockids[b].subtypes[d % mask];
+			material *mat = &tex->materials[b * BLOCK_SUBTYPES + d];
+			memcpy(mat->colour, btype->palette[COLOUR1], CHANNELS);
+			mat->biome_row = biome_rows[d % mask];
+			mat->type = b * BLOCK_SUBTYPES + d % mask;
+			mat->id = btype->id;
+			mat->tint = mat->biome_row >= 0 ? btype->tints[0] : TINT_NONE;
+		}
+	}
+}
+
+
 // adjust a block colour's hue toward that of a biome colour
 static void mix_biome_colour(uint8_t *biome_block_colour, const uint8_t *block_colour,
 		biome *biome, const uint8_t biome_colourtype)
@@ -289,16 +434,19 @@ static void mix_biome_colour(uint8_t *biome_block_colour, const uint8_t *block_c
 }
 
 
-textures *read_textures(const char *texpath, const char *shapepath, const char *biomepath)
+textures *read_textures(const char *texpath, const char *shapepath, const char *biomepath,
+		const resource_colours *rescolours)
 {
 	textures *tex = (textures*)calloc(1, sizeof(textures));
 
 	shape *shapes = NULL;
 	if (shapepath != NULL) read_shapes(&shapes, shapepath);
 
-	biome *biomes = NULL;
-	uint8_t biomecount;
-	if (biomepath != NULL) biomecount = read_biomes(&biomes, biomepath);
+	// the biomes are kept, so that blended biome colours can be compared with each column's own
+	uint8_t biomecount = 0;
+	if (biomepath != NULL) biomecount = read_biomes(&tex->biomes, biomepath);
+	tex->biomecount = biomecount;
+	biome *biomes = tex->biomes;
 
 	// colour/texture file
 	FILE *tcsv = fopen(texpath, "r");
@@ -340,10 +488,19 @@ textures *read_textures(const char *texpath, const char *shapepath, const char *
 		btype->id = row[BLOCKID];
 		btype->subtype = row[SUBTYPE];
 
-		// copy colours and adjust
+		// copy colours, replacing them with any taken from a resource pack, and adjust
 		memcpy(&btype->palette[COLOUR1], &row[RED1], CHANNELS);
-		add_hilight_and_shadow(btype->palette[COLOUR1]);
 		memcpy(&btype->palette[COLOUR2], &row[RED2], CHANNELS);
+		if (rescolours != NULL)
+			for (uint8_t c = 0; c < 2; c++)
+			{
+				uint8_t flags = rescolours->flags[row[BLOCKID]][row[SUBTYPE]];
+				const uint8_t *rcolour = rescolours->colours[row[BLOCKID]][row[SUBTYPE]][c];
+				uint8_t *colour = btype->palette[c ? COLOUR2 : COLOUR1];
+				if (flags & RESOURCE_COLOUR(c)) memcpy(colour, rcolour, ALPHA);
+				if (flags & RESOURCE_ALPHA(c)) colour[ALPHA] = rcolour[ALPHA];
+			}
+		add_hilight_and_shadow(btype->palette[COLOUR1]);
 		add_hilight_and_shadow(btype->palette[COLOUR2]);
 
 		// check if this block type uses biome colours
@@ -351,6 +508,8 @@ textures *read_textures(const char *texpath, const char *shapepath, const char *
 		{
 			// calculate colours for this block type in every biome
 			btype->biome_palettes = (palette*)calloc(biomecount, sizeof(palette));
+			btype->tints[0] = row[BIOME_COLOUR1];
+			btype->tints[1] = row[BIOME_COLOUR2];
 
 			for (uint8_t b = 0; b < biomecount; b++)
 				if (biomes[b].exists)
@@ -370,12 +529,222 @@ textures *read_textures(const char *texpath, const char *shapepath, const char *
 			btype->shapes[1] = shapes[row[SHAPE_E] || row[SHAPE_N]];
 			btype->shapes[2] = shapes[row[SHAPE_S] || row[SHAPE_N]];
 			btype->shapes[3] = shapes[row[SHAPE_W] || row[SHAPE_N]];
+
+			for (uint8_t r = 0; r < 4; r++)
+				for (uint8_t blocked = 0; blocked < 4; blocked++)
+					btype->pixmaps[r][blocked] = pack_pixmap(&btype->shapes[r], blocked);
 		}
 	}
 	fclose(tcsv);
 
+	fill_materials(tex);
+
+	if (shapepath != NULL)
+	{
+		// isometric maps look up their shaded block colours in a cache, which starts out empty
+		tex->palette_cache = (shaded_palette*)calloc(PALETTE_CACHE_SIZE, sizeof(shaded_palette));
+
+		// store shape flags in the materials, so that isometric maps can find hidden blocks
+		// without looking up each block's type
+		fill_shape_flags(tex->materials, tex, biomecount);
+	}
+
 	free(shapes);
-	free(biomes);
+
+	return tex;
+}
+
+
+// round a pack file offset up to the pack's alignment
+static uint64_t align_pack_offset(const uint64_t offset)
+{
+	return (offset + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+
+bool write_texture_pack(const char *packpath, const char *texpath, const char *shapepath,
+		const char *biomepath, const resource_colours *rescolours)
+{
+	textures *tex = read_textures(texpath, shapepath, biomepath, rescolours);
+	const int idcount = tex->max_blockid + 1;
+
+	pack_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.blockid_size = sizeof(blockID);
+	header.max_blockid = tex->max_blockid;
+	header.biomecount = tex->biomecount;
+	header.blockids = align_pack_offset(sizeof(header));
+	const uint32_t matsize = idcount * BLOCK_SUBTYPES * sizeof(material);
+	header.materials[0] = align_pack_offset(header.blockids + idcount * sizeof(blockID));
+	header.materials[1] = header.materials[0] + matsize;
+	for (int b = 0; b < idcount; b++)
+		for (int s = 0; s < BLOCK_SUBTYPES; s++)
+			if (tex->blockids[b].subtypes[s].biome_palettes != NULL) header.biome_typecount++;
+	const uint32_t coloursize = header.biome_typecount * tex->biomecount * CHANNELS;
+	header.biome_colours = align_pack_offset(header.materials[1] + matsize);
+	header.biomes = align_pack_offset(header.biome_colours + coloursize);
+	header.size = align_pack_offset(header.biomes + tex->biomecount * sizeof(biome)) +
+			header.biome_typecount * tex->biomecount * sizeof(palette);
+
+	// lay out the whole file in memory
+	uint8_t *data = (uint8_t*)calloc(header.size, sizeof(uint8_t));
+	memcpy(data, &header, sizeof(header));
+	blockID *blockids = (blockID*)(data + header.blockids);
+	memcpy(blockids, tex->blockids, idcount * sizeof(blockID));
+	// the materials with biome colours were already filled in by read_textures
+	material *materials = (material*)(data + header.materials[0]);
+	memcpy(materials, tex->materials, matsize);
+	for (uint32_t m = 0; m < idcount * BLOCK_SUBTYPES; m++) materials[m].biome_row = -1;
+	fill_shape_flags(materials, tex, 0);
+	memcpy(data + header.materials[1], tex->materials, matsize);
+	memcpy(data + header.biome_colours, tex->biome_colours, coloursize);
+	memcpy(data + header.biomes, tex->biomes, tex->biomecount * sizeof(biome));
+
+	// copy each block type's biome palettes after everything else, and replace its pointer with
+	// their offset in the file
+	uint64_t offset = align_pack_offset(header.biomes + tex->biomecount * sizeof(biome));
+	for (int b = 0; b < idcount; b++)
+		for (int s = 0; s < BLOCK_SUBTYPES; s++)
+		{
+			blocktype *btype = &blockids[b].subtypes[s];
+			if (btype->biome_palettes == NULL) continue;
+			memcpy(data + offset, btype->biome_palettes, tex->biomecount * sizeof(palette));
+			btype->biome_palettes = (palette*)(uintptr_t)offset;
+			offset += tex->biomecount * sizeof(palette);
+		}
+
+	bool ok = 0;
+	FILE *pack = fopen(packpath, "wb");
+	if (pack == NULL)
+		fprintf(stderr, "Error %d writing texture pack: %s\n", errno, packpath);
+	else
+	{
+		ok = fwrite(data, header.size, 1, pack) == 1;
+		ok &= fclose(pack) == 0;
+		if (!ok) fprintf(stderr, "Error writing texture pack: %s\n", packpath);
+	}
+
+	free(data);
+	free_textures(tex);
+	return ok;
+}
+
+
+// check that a range of a pack file lies within the file
+static bool pack_range_fits(const pack_header *header, const uint64_t offset,
+		const uint64_t length)
+{
+	return offset <= header->size && length <= header->size - offset;
+}
+
+
+// check that every table and palette a pack's header and block types point to lies within the
+// file, so that a damaged pack can't send lookups outside of it
+static bool check_texture_pack(const uint8_t *pack)
+{
+	const pack_header *header = (pack_header*)pack;
+	if (header->max_blockid > 255) return 0;
+	const uint64_t idcount = header->max_blockid + 1;
+	const uint64_t matsize = idcount * BLOCK_SUBTYPES * sizeof(material);
+	if (!pack_range_fits(header, header->blockids, idcount * sizeof(blockID)) ||
+			!pack_range_fits(header, header->materials[0], matsize) ||
+			!pack_range_fits(header, header->materials[1], matsize) ||
+			!pack_range_fits(header, header->biome_colours,
+					(uint64_t)header->biome_typecount * header->biomecount * CHANNELS) ||
+			!pack_range_fits(header, header->biomes, header->biomecount * sizeof(biome)))
+		return 0;
+
+	// the biome rows of the materials index the biome colours, and their types the block types
+	for (int m = 0; m < 2; m++)
+	{
+		const material *materials = (material*)(pack + header->materials[m]);
+		for (uint64_t i = 0; i < idcount * BLOCK_SUBTYPES; i++)
+			if (materials[i].biome_row < -1 ||
+					materials[i].biome_row >= (int64_t)header->biome_typecount ||
+					materials[i].type >= idcount * BLOCK_SUBTYPES)
+				return 0;
+	}
+
+	const blockID *blockids = (blockID*)(pack + header->blockids);
+	for (uint64_t b = 0; b < idcount; b++)
+		for (int s = 0; s < BLOCK_SUBTYPES; s++)
+		{
+			uintptr_t offset = (uintptr_t)blockids[b].subtypes[s].biome_palettes;
+			if (offset != 0 &&
+					!pack_range_fits(header, offset, header->biomecount * sizeof(palette)))
+				return 0;
+		}
+	return 1;
+}
+
+
+textures *load_texture_pack(const char *packpath, const bool isometric, const bool biomes)
+{
+	int fd = open(packpath, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error %d reading texture pack: %s\n", errno, packpath);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(pack_header))
+	{
+		fprintf(stderr, "Invalid texture pack: %s\n", packpath);
+		close(fd);
+		return NULL;
+	}
+
+	// map the file privately, so that the biome palette offsets can be turned back into pointers
+	// without writing to it; only the pages holding those block types get copied
+	uint8_t *pack = (uint8_t*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pack == MAP_FAILED)
+	{
+		fprintf(stderr, "Error %d mapping texture pack: %s\n", errno, packpath);
+		return NULL;
+	}
+
+	const pack_header *header = (pack_header*)pack;
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) ||
+			header->version != PACK_VERSION || header->blockid_size != sizeof(blockID) ||
+			header->size != (uint64_t)st.st_size)
+	{
+		fprintf(stderr, "Texture pack %s was written by a different version, "
+				"and needs to be compiled again\n", packpath);
+		munmap(pack, st.st_size);
+		return NULL;
+	}
+	if (!check_texture_pack(pack))
+	{
+		fprintf(stderr, "Texture pack %s is damaged, and needs to be compiled again\n",
+				packpath);
+		munmap(pack, st.st_size);
+		return NULL;
+	}
+
+	textures *tex = (textures*)calloc(1, sizeof(textures));
+	tex->pack = pack;
+	tex->packsize = st.st_size;
+	tex->max_blockid = header->max_blockid;
+	tex->biomecount = biomes ? header->biomecount : 0;
+	tex->blockids = (blockID*)(pack + header->blockids);
+	tex->materials = (material*)(pack + header->materials[biomes]);
+	tex->biome_colours = (uint8_t(*)[CHANNELS])(pack + header->biome_colours);
+	tex->biomes = biomes ? (biome*)(pack + header->biomes) : NULL;
+
+	for (int b = 0; b <= tex->max_blockid; b++)
+		for (int s = 0; s < BLOCK_SUBTYPES; s++)
+		{
+			blocktype *btype = &tex->blockids[b].subtypes[s];
+			if (btype->biome_palettes != NULL)
+				btype->biome_palettes =
+						biomes ? (palette*)(pack + (uintptr_t)btype->biome_palettes) : NULL;
+		}
+
+	if (isometric)
+		tex->palette_cache = (shaded_palette*)calloc(PALETTE_CACHE_SIZE, sizeof(shaded_palette));
 
 	return tex;
 }
@@ -383,10 +752,23 @@ textures *read_textures(const char *texpath, const char *shapepath, const char *
 
 void free_textures(textures *tex)
 {
+	if (tex->pack != NULL)
+	{
+		// the block types, materials and biomes live in the mapped file
+		munmap(tex->pack, tex->packsize);
+		free(tex->palette_cache);
+		free(tex);
+		return;
+	}
+
 	for (int b = 0; b <= tex->max_blockid; b++)
 		for (int s = 0; s < BLOCK_SUBTYPES; s++)
 			free(tex->blockids[b].subtypes[s].biome_palettes);
 	free(tex->blockids);
+	free(tex->materials);
+	free(tex->biome_colours);
+	free(tex->biomes);
+	free(tex->palette_cache);
 	free(tex);
 }
 
@@ -420,10 +802,9 @@ void combine_alpha(uint8_t *top, uint8_t *bottom, bool down)
 		return;
 	}
 
-	float bmod = (float)(255 - top[ALPHA]) / 255;
-	uint8_t alpha = top[ALPHA] + bottom[ALPHA] * bmod;
+	// the bottom colour shows through in proportion to the top colour's transparency
+	uint8_t bmod = 255 - top[ALPHA];
 	uint8_t *target = down ? bottom : top;
-	for (uint8_t ch = 0; ch < ALPHA; ch++)
-		target[ch] = (top[ch] * top[ALPHA] + bottom[ch] * bottom[ALPHA] * bmod) / alpha;
-	target[ALPHA] = alpha;
+	for (uint8_t ch = 0; ch < CHANNELS; ch++)
+		target[ch] = top[ch] + scale_channel(bottom[ch], bmod);
 }
@@ -22,6 +22,7 @@
 
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "data.h"
@@ -54,6 +55,24 @@
 
 #define BLOCK_SUBTYPES 16
 
+// sides of an isometric block that are blocked by a solid neighbour, hiding its hilight/shadow
+#define HILIGHT_BLOCKED 1
+#define SHADOW_BLOCKED 2
+
+// flags for a block's shape in a given rotation: no blank pixels, and also no translucent colours
+#define SOLID_SHAPE(rotate) (1 << (rotate))
+#define OPAQUE_SHAPE(rotate) (1 << ((rotate) + 4))
+
+// flags for a block type's colours that were taken from a resource pack: the colour, and also the
+// alpha if the texture is translucent
+#define RESOURCE_COLOUR(c) (1 << ((c) * 2))
+#define RESOURCE_ALPHA(c) (2 << ((c) * 2))
+
+// size of the shaded palette cache, and how many slots to try before giving up on a lookup
+#define PALETTE_CACHE_BITS 15
+#define PALETTE_CACHE_SIZE (1 << PALETTE_CACHE_BITS)
+#define PALETTE_CACHE_PROBES 8
+
 
 // isometric colour codes as used in the shape CSV
 typedef enum
@@ -77,6 +96,15 @@ typedef struct shape
 }
 shape;
 
+// which of a biome's colours tints a block colour, as used in the texture CSV
+typedef enum
+{
+	TINT_NONE,
+	TINT_FOLIAGE,
+	TINT_GRASS
+}
+tints;
+
 // colour overlays for foliage and grass blocks in a specific biome
 typedef struct biome
 {
@@ -97,10 +125,21 @@ typedef struct blocktype
 	palette palette;         // palette to use for this block type
 	palette *biome_palettes; // array of palettes to use for this block in each biome
 	                         //   or NULL if biomes don't apply to this block type
+	uint8_t tints[2];        // which biome colour tints each of the two colours in a biome
 	shape shapes[4];         // array of isometric shape structs to use for each rotation
+	uint64_t pixmaps[4][4];  // shape pixel maps packed as 4-bit colour codes, first pixel lowest,
+	                         //   for each rotation and combination of blocked sides
 }
 blocktype;
 
+// a palette with height and light shading already applied, stored in the shaded palette cache
+typedef struct shaded_palette
+{
+	uint64_t key;    // packed block type, biome, height and light levels, or 0 if the slot is empty
+	palette palette; // fully shaded palette for this key
+}
+shaded_palette;
+
 // a block id which has one or more block types associated with it
 typedef struct blockID
 {
@@ -109,21 +148,88 @@ typedef struct blockID
 }
 blockID;
 
+// everything about a block type that the inner drawing loops need, kept in a compact table so
+// that drawing a block doesn't have to look up its whole block type; entries are padded to 16
+// bytes, so that four share each cache line of the aligned table and none straddles two
+typedef struct material
+{
+	uint8_t colour[CHANNELS]; // RGBA colour of the block type's top face
+	int16_t biome_row;        // row of the block type's top colours in the texture's biome
+	                          //   colours, or -1 if biomes don't apply to it
+	uint16_t type;            // index of the block type's struct, as block id * BLOCK_SUBTYPES +
+	                          //   subtype, for its shapes and palettes
+	uint8_t id;               // block id that the block type's struct was given
+	uint8_t tint;             // which biome colour tints the top face in a biome
+	uint8_t shape_flags;      // solid/opaque flags of the block type's shape in each rotation,
+	                          //   if it has shapes
+}
+__attribute__((aligned(16))) material;
+
+// average colours of block textures in a resource pack, to use in place of the CSV colours
+typedef struct resource_colours
+{
+	uint8_t flags[256][BLOCK_SUBTYPES];                // resource flags for both colours of each
+	                                                   //   block id and subtype
+	uint8_t colours[256][BLOCK_SUBTYPES][2][CHANNELS]; // colours 1 and 2 of each block id and
+	                                                   //   subtype
+}
+resource_colours;
+
 // a set of block types and their corresponding colour/shape data
 typedef struct textures
 {
-	uint8_t max_blockid; // highest block id present in the CSV file
-	blockID *blockids;   // array of block id structs for each block id in the CSV file
+	uint8_t max_blockid;           // highest block id present in the CSV file
+	uint16_t biomecount;           // number of palettes in each block type's biome palettes
+	biome *biomes;                 // array of biome structs for each biome id, or NULL if not
+	                               //   rendering biomes
+	blockID *blockids;             // array of block id structs for each block id in the CSV file
+	material *materials;           // materials indexed by block id and data value
+	uint8_t (*biome_colours)[CHANNELS]; // top colours in every biome of each block type that
+	                                    //   biomes apply to
+	shaded_palette *palette_cache; // hash table of shaded palettes, filled in while rendering
+	                               //   or NULL if not rendering an isometric map
+	uint8_t *pack;                 // memory mapped texture pack file that the block id structs,
+	                               //   biome palettes and materials live in, or NULL
+	size_t packsize;               // size of the mapped texture pack file
 }
 textures;
 
 
+/* read the average colours of the block textures in an unpacked resource pack, or reuse the ones
+ * cached in the pack by an earlier run if none of the textures have changed since; return NULL if
+ * the texture list can't be read
+ *   respath: path to the resource pack directory
+ *   mappath: path to a CSV file listing the textures to use for each block type's colours
+ */
+resource_colours *read_resource_colours(const char *respath, const char *mappath);
+
 /* generate a texture struct from a set of CSV files
- *   texpath:   path to the block texture/colour CSV
- *   shapepath: path to the isometric shape CSV (or NULL if not rendering an isometric map)
- *   biomepath: path to the biome colour CSV (or NULL if not rendering biomes)
+ *   texpath:    path to the block texture/colour CSV
+ *   shapepath:  path to the isometric shape CSV (or NULL if not rendering an isometric map)
+ *   biomepath:  path to the biome colour CSV (or NULL if not rendering biomes)
+ *   rescolours: colours from a resource pack to use in place of the CSV colours, or NULL
+ */
+textures *read_textures(const char *texpath, const char *shapepath, const char *biomepath,
+		const resource_colours *rescolours);
+
+/* read a set of CSV files with every option, and write the resulting block types to a compiled
+ * texture pack file that can be loaded much faster; return false if the file couldn't be written
+ *   packpath:   path to the output texture pack file
+ *   texpath:    path to the block texture/colour CSV
+ *   shapepath:  path to the isometric shape CSV
+ *   biomepath:  path to the biome colour CSV
+ *   rescolours: colours from a resource pack to use in place of the CSV colours, or NULL
+ */
+bool write_texture_pack(const char *packpath, const char *texpath, const char *shapepath,
+		const char *biomepath, const resource_colours *rescolours);
+
+/* generate a texture struct by mapping a compiled texture pack file into memory, or return NULL
+ * if it can't be read or was written by an incompatible version
+ *   packpath:  path to the texture pack file
+ *   isometric: whether we are rendering an isometric map
+ *   biomes:    whether we are rendering biome colours
  */
-textures *read_textures(const char *texpath, const char *shapepath, const char *biomepath);
+textures *load_texture_pack(const char *packpath, const bool isometric, const bool biomes);
 
 /* free the memory used for a texture struct
  *   tex: pointer to the texture struct
@@ -137,13 +243,49 @@ void free_textures(textures *tex);
  */
 const blocktype *get_block_type(const textures *tex, const uint8_t blockid, const uint8_t dataval);
 
+/* get a block's entry in the material table
+ *   tex:     texture struct containing the material table
+ *   blockid: block id, no higher than the highest block id in the texture struct
+ *   dataval: block data value
+ */
+static inline const material *get_block_material(const textures *tex, const uint8_t blockid,
+		const uint8_t dataval)
+{
+	return &tex->materials[blockid * BLOCK_SUBTYPES + dataval];
+}
+
+/* get the block type struct that a material was built from
+ *   tex: texture struct containing the material table
+ *   mat: pointer to the material
+ */
+static inline const blocktype *get_material_type(const textures *tex, const material *mat)
+{
+	return &tex->blockids[mat->type / BLOCK_SUBTYPES].subtypes[mat->type % BLOCK_SUBTYPES];
+}
+
+/* get the top colour of a block from the material table, using its colour in a biome if biomes
+ * apply to it
+ *   tex:     texture struct containing the material table
+ *   blockid: block id, no higher than the highest block id in the texture struct
+ *   dataval: block data value
+ *   biomes:  whether we are rendering biome colours
+ *   biome:   biome id of the block's column
+ */
+static inline const uint8_t *get_block_colour(const textures *tex, const uint8_t blockid,
+		const uint8_t dataval, const bool biomes, const uint8_t biome)
+{
+	const material *mat = get_block_material(tex, blockid, dataval);
+	return biomes && mat->biome_row >= 0 ?
+			tex->biome_colours[mat->biome_row * tex->biomecount + biome] : mat->colour;
+}
+
 /* make an RGB colour lighter or darker
  *   pixel: pointer to the colour or pixel buffer
  *   mod:   a float value from -1 to 1 representing the percentage to lighten or darken
  */
 void adjust_colour_brightness(unsigned char *pixel, float mod);
 
-/* alpha blend one RGBA colour on top of another, replacing one of them
+/* alpha blend one premultiplied RGBA colour on top of another, replacing one of them
  *   top:    pointer to the top colour or pixel buffer
  *   bottom: pointer to the bottom colour or pixel buffer
  *   down:   whether to store the result in the bottom buffer (true) or the top buffer (false)
@@ -21,9 +21,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "data.h"
+#include "image.h"
 #include "map.h"
 #include "textures.h"
 
@@ -94,8 +96,48 @@ static void get_world_margins(uint32_t *margins, const worldinfo *world, const b
 void render_world_map(image *img, int32_t wpx, int32_t wpy, const worldinfo *world,
 		const options *opts)
 {
-	textures *tex = (opts->tiny ? NULL : read_textures(opts->texpath,
-			opts->isometric ? opts->shapepath : NULL, opts->biomes ? opts->biomepath : NULL));
+	render_world_maps(&img, NULL, &wpx, &wpy, 1, world, opts);
+}
+
+
+// load the block textures for a map, from its compiled texture pack if it has a usable one, or
+// else from the CSV files and any resource pack
+static textures *get_map_textures(const options *opts)
+{
+	textures *tex = NULL;
+	if (opts->packpath != NULL)
+		tex = load_texture_pack(opts->packpath, opts->isometric, opts->biomes);
+	if (tex == NULL)
+	{
+		resource_colours *rescolours = opts->respath != NULL ?
+				read_resource_colours(opts->respath, opts->mappath) : NULL;
+		tex = read_textures(opts->texpath, opts->isometric ? opts->shapepath : NULL,
+				opts->biomes ? opts->biomepath : NULL, rescolours);
+		free(rescolours);
+	}
+	return tex;
+}
+
+
+void render_world_maps(image **imgs, raster **rasters, const int32_t *wpx, const int32_t *wpy,
+		const uint16_t count, const worldinfo *world, const options *opts)
+{
+	// tiny maps are drawn straight from the region headers, so only the others need chunk data
+	map_target targets[count];
+	uint16_t tcount = 0;
+	for (uint16_t m = 0; m < count; m++)
+	{
+		if (opts[m].tiny) continue;
+		targets[tcount++] = (map_target){
+			.img  = imgs[m],
+			.ras  = rasters != NULL ? rasters[m] : NULL,
+			.tex  = get_map_textures(&opts[m]),
+			// keep track of opaque areas, so isometric chunks hidden behind them can be skipped
+			.cov  = opts[m].isometric ? create_coverage(imgs[m]) : NULL,
+			.opts = &opts[m],
+		};
+	}
+	init_shading_tables();
 
 	uint32_t r = 0;
 	// we need to render the regions in order from bottom to top for isometric view
@@ -110,65 +152,70 @@ void render_world_map(image *img, int32_t wpx, int32_t wpy, const worldinfo *wor
 			r++;
 			printf("Rendering region %d/%d (%d,%d)...\n", r, world->rcount, reg->x, reg->z);
 
-			uint32_t rpx, rpy;
-
-			if (opts->tiny)
+			for (uint16_t m = 0, t = 0; m < count; m++)
 			{
-				rpx = rrx * REGION_CHUNK_LENGTH;
-				rpy = rrz * REGION_CHUNK_LENGTH;
-				render_tiny_region_map(img, rpx, rpy, reg, opts);
-			}
-			else
-			{
-				if (opts->isometric)
+				if (opts[m].tiny)
+				{
+					render_tiny_region_map(imgs[m], rrx * REGION_CHUNK_LENGTH,
+							rrz * REGION_CHUNK_LENGTH, reg, &opts[m]);
+					continue;
+				}
+
+				map_target *target = &targets[t++];
+				if (opts[m].isometric)
 				{
 					// translate orthographic region coordinates to isometric pixel coordinates
-					rpx = (rrx + world->rrzmax - rrz) * ISO_REGION_X_MARGIN + wpx;
-					rpy = (rrx + rrz)                 * ISO_REGION_Y_MARGIN + wpy;
+					target->rpx = (rrx + world->rrzmax - rrz) * ISO_REGION_X_MARGIN + wpx[m];
+					target->rpy = (rrx + rrz)                 * ISO_REGION_Y_MARGIN + wpy[m];
 				}
 				else
 				{
-					rpx = rrx * REGION_BLOCK_LENGTH + wpx;
-					rpy = rrz * REGION_BLOCK_LENGTH + wpy;
+					// turn the region the rest of the way to the map's own rotation
+					uint32_t mrx = rrx, mrz = rrz;
+					rotate_coords(&mrx, &mrz, world->rrxsize, world->rrzsize,
+							opts[m].rotate - world->rotate);
+					target->rpx = (mrx * REGION_BLOCK_LENGTH >> opts[m].zoom) + wpx[m];
+					target->rpy = (mrz * REGION_BLOCK_LENGTH >> opts[m].zoom) + wpy[m];
 				}
+			}
+			if (tcount == 0) continue;
 
-				// get rotated neighbouring regions
-				region *nregions[4] =
-				{
-					get_region_from_coords(world, rrx, rrz - 1),
-					get_region_from_coords(world, rrx + 1, rrz),
-					get_region_from_coords(world, rrx, rrz + 1),
-					get_region_from_coords(world, rrx - 1, rrz),
-				};
+			// get rotated neighbouring regions
+			region *nregions[4] =
+			{
+				get_region_from_coords(world, rrx, rrz - 1),
+				get_region_from_coords(world, rrx + 1, rrz),
+				get_region_from_coords(world, rrx, rrz + 1),
+				get_region_from_coords(world, rrx - 1, rrz),
+			};
 
-				render_region_map(img, rpx, rpy, reg, nregions, tex, opts);
-			}
+			render_region_maps(targets, tcount, reg, nregions, world->rotate);
 		}
 	}
 
-	if (!opts->tiny) free_textures(tex);
+	for (uint16_t t = 0; t < tcount; t++)
+	{
+		free_coverage(targets[t].cov);
+		free_textures((textures*)targets[t].tex);
+	}
 }
 
 
-image *create_world_map(char *worldpath, const options *opts)
+// get the pixel dimensions of the world map, and the width of the margin cropped from each edge
+static void get_world_map_size(uint32_t *width, uint32_t *height, uint32_t *margins,
+		const worldinfo *world, const options *opts)
 {
-	worldinfo *world = measure_world(worldpath,
-		opts->rotate, opts->limits, opts->nether, opts->end);
-	if (world == NULL) return NULL;
-
-	uint32_t width, height, margins[4];
-
 	if (opts->tiny)
 	{
-		width  = world->rrxsize * REGION_CHUNK_LENGTH;
-		height = world->rrzsize * REGION_CHUNK_LENGTH;
+		*width  = world->rrxsize * REGION_CHUNK_LENGTH;
+		*height = world->rrzsize * REGION_CHUNK_LENGTH;
 	}
 	else
 	{
 		if (opts->isometric)
 		{
-			width  = (world->rrxsize + world->rrzsize) * ISO_REGION_X_MARGIN;
-			height = (world->rrxsize + world->rrzsize) * ISO_REGION_Y_MARGIN
+			*width  = (world->rrxsize + world->rrzsize) * ISO_REGION_X_MARGIN;
+			*height = (world->rrxsize + world->rrzsize) * ISO_REGION_Y_MARGIN
 					- ISO_BLOCK_TOP_HEIGHT + ISO_CHUNK_DEPTH;
 			if (opts->ylimits != NULL)
 			{
@@ -178,23 +225,232 @@ image *create_world_map(char *worldpath, const options *opts)
 		}
 		else
 		{
-			width  = world->rrxsize * REGION_BLOCK_LENGTH;
-			height = world->rrzsize * REGION_BLOCK_LENGTH;
+			*width  = world->rrxsize * REGION_BLOCK_LENGTH;
+			*height = world->rrzsize * REGION_BLOCK_LENGTH;
 		}
 
 		get_world_margins(margins, world, opts->isometric);
-		width  -= (margins[LEFT] + margins[RIGHT]);
-		height -= (margins[TOP] + margins[BOTTOM]);
+		if (!opts->isometric)
+		{
+			// start the map on a whole square of the columns sampled at this zoom level
+			margins[TOP] -= margins[TOP] % (1 << opts->zoom);
+			margins[LEFT] -= margins[LEFT] % (1 << opts->zoom);
+		}
+		*width  -= (margins[LEFT] + margins[RIGHT]);
+		*height -= (margins[TOP] + margins[BOTTOM]);
+
+		// convert block dimensions to pixels at this zoom level
+		if (!opts->isometric && opts->zoom)
+		{
+			*width  = (*width  + (1 << opts->zoom) - 1) >> opts->zoom;
+			*height = (*height + (1 << opts->zoom) - 1) >> opts->zoom;
+			for (uint8_t i = 0; i < 4; i++) margins[i] >>= opts->zoom;
+		}
+	}
+}
+
+
+image *create_world_map(char *worldpath, const options *opts)
+{
+	image *img;
+	return create_world_maps(&img, NULL, worldpath, opts, 1) ? img : NULL;
+}
+
+
+bool create_world_maps(image **imgs, raster **rasters, char *worldpath, const options *opts,
+		const uint16_t count)
+{
+	// measure the world once for each rotate value, to get the size of the maps that use it
+	worldinfo *worlds[4] = {NULL};
+	for (uint16_t m = 0; m < count; m++)
+	{
+		uint8_t r = opts[m].rotate;
+		if (worlds[r] != NULL) continue;
+		worlds[r] = measure_world(worldpath, r, opts->limits, opts->nether, opts->end);
+		if (worlds[r] == NULL)
+		{
+			for (uint8_t i = 0; i < 4; i++) if (worlds[i] != NULL) free_world(worlds[i]);
+			return 0;
+		}
+	}
+	printf("Read %d regions.\n", worlds[opts->rotate]->rcount);
+
+	int32_t wpx[count], wpy[count];
+	for (uint16_t m = 0; m < count; m++)
+	{
+		uint32_t width, height, margins[4] = {0};
+		get_world_map_size(&width, &height, margins, worlds[opts[m].rotate], &opts[m]);
+
+		if (opts[m].raster != RASTER_NONE)
+		{
+			imgs[m] = NULL;
+			rasters[m] = create_raster(width, height);
+			printf("Raster dimensions: %d x %d\n", width, height);
+		}
+		else
+		{
+			imgs[m] = create_image(width, height);
+			if (rasters != NULL) rasters[m] = NULL;
+			printf("Image dimensions: %d x %d\n", width, height);
+		}
+		wpx[m] = -margins[LEFT];
+		wpy[m] = -margins[TOP];
 	}
 
-	image *img = create_image(width, height);
+	clock_t start = clock();
+
+	// the world is read in the order that isometric maps must be drawn in, which is different
+	// for each rotate value, so each pass renders the isometric and tiny maps with one rotate
+	// value, and the first pass also renders every orthographic map
+	bool done[count];
+	memset(done, 0, sizeof(done));
+	for (bool first = 1; ; first = 0)
+	{
+		int16_t rotate = -1;
+		for (uint16_t m = 0; m < count && rotate < 0; m++)
+			if (!done[m] && (opts[m].isometric || opts[m].tiny)) rotate = opts[m].rotate;
+		if (rotate < 0 && !first) break;
+		if (rotate < 0) rotate = opts->rotate;
+
+		image *pimgs[count];
+		raster *prasters[count];
+		int32_t pwpx[count], pwpy[count];
+		options popts[count];
+		uint16_t pcount = 0;
+		for (uint16_t m = 0; m < count; m++)
+		{
+			if (done[m] || ((opts[m].isometric || opts[m].tiny) && opts[m].rotate != rotate))
+				continue;
+			pimgs[pcount] = imgs[m];
+			prasters[pcount] = rasters != NULL ? rasters[m] : NULL;
+			pwpx[pcount] = wpx[m];
+			pwpy[pcount] = wpy[m];
+			popts[pcount++] = opts[m];
+			done[m] = 1;
+		}
+		render_world_maps(pimgs, prasters, pwpx, pwpy, pcount, worlds[rotate], popts);
+	}
+
+	printf("Total render time: %f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+
+	for (uint8_t r = 0; r < 4; r++) if (worlds[r] != NULL) free_world(worlds[r]);
+
+	return 1;
+}
+
+
+// write the rows of the window that lie within the image, starting at the given pixel y coord
+static void write_window_rows(png_stream *png, const image *window, const int32_t wy,
+		const uint32_t rows)
+{
+	int32_t first = MAX(0, -wy);
+	int32_t last = MIN((int32_t)rows, (int32_t)png->height - wy);
+	if (last > first)
+		write_png_rows(png, &window->data[first * window->width * CHANNELS], last - first);
+}
+
+
+bool stream_world_map(char *worldpath, const char *imgpath, const options *opts)
+{
+	worldinfo *world = measure_world(worldpath,
+		opts->rotate, opts->limits, opts->nether, opts->end);
+	if (world == NULL) return 0;
+
+	uint32_t width, height, margins[4] = {0};
+	get_world_map_size(&width, &height, margins, world, opts);
 	printf("Read %d regions. Image dimensions: %d x %d\n", world->rcount, width, height);
 
+	png_stream *png = open_png_stream(imgpath, width, height);
+	if (png == NULL)
+	{
+		free_world(world);
+		return 0;
+	}
+
+	textures *tex = get_map_textures(opts);
+	init_shading_tables();
+
+	// each band is one row of regions, which in isometric mode is a diagonal row
+	uint32_t bcount, bheight, rwidth, rheight;
+	if (opts->isometric)
+	{
+		bcount = world->rrxsize + world->rrzsize - 1;
+		bheight = ISO_REGION_Y_MARGIN;
+		rwidth = ISO_REGION_WIDTH;
+		rheight = ISO_REGION_HEIGHT;
+	}
+	else
+	{
+		bcount = world->rrzsize;
+		bheight = rwidth = rheight = REGION_BLOCK_LENGTH >> opts->zoom;
+	}
+
+	// the window holds all the rows that a band's regions cover, which in isometric mode
+	// overlap the bands below; each region is rendered separately, then composited on top
+	image *window = create_image(width, rheight);
+	image *rimg = create_image(rwidth, rheight);
+	coverage *cov = opts->isometric ? create_coverage(rimg) : NULL;
+	uint32_t r = 0;
+
 	clock_t start = clock();
-	render_world_map(img, -margins[LEFT], -margins[TOP], world, opts);
+	for (uint32_t b = 0; b < bcount; b++)
+	{
+		// pixel y coord of the window's top row
+		int32_t wy = b * bheight - margins[TOP];
+
+		for (uint32_t rrx = 0; rrx <= world->rrxmax; rrx++)
+		{
+			int32_t rrz = opts->isometric ? (int32_t)(b - rrx) : b;
+			if (rrz < 0) break;
+
+			// get region, or skip if it doesn't exist
+			region *reg = get_region_from_coords(world, rrx, rrz);
+			if (reg == NULL) continue;
+
+			r++;
+			printf("Rendering region %d/%d (%d,%d)...\n", r, world->rcount, reg->x, reg->z);
+
+			region *nregions[4] =
+			{
+				get_region_from_coords(world, rrx, rrz - 1),
+				get_region_from_coords(world, rrx + 1, rrz),
+				get_region_from_coords(world, rrx, rrz + 1),
+				get_region_from_coords(world, rrx - 1, rrz),
+			};
+
+			memset(rimg->data, 0, rwidth * rheight * CHANNELS);
+			if (cov != NULL) clear_coverage(cov);
+			render_region_map(rimg, cov, 0, 0, reg, nregions, tex, opts);
+
+			// composite the region over the rows already in the window
+			int32_t rpx = (opts->isometric ? (rrx + world->rrzmax - rrz) * ISO_REGION_X_MARGIN :
+					rrx * REGION_BLOCK_LENGTH >> opts->zoom) - margins[LEFT];
+			for (uint32_t y = 0; y < rheight; y++)
+				for (uint32_t x = MAX(0, -rpx); x < rwidth && rpx + x < width; x++)
+				{
+					uint8_t *pixel = &rimg->data[(y * rwidth + x) * CHANNELS];
+					if (pixel[ALPHA] > 0)
+						combine_alpha(pixel, &window->data[(y * width + rpx + x) * CHANNELS], 1);
+				}
+		}
+
+		// the top band of the window is now finished, so write it and scroll the window up
+		write_window_rows(png, window, wy, bheight);
+		memmove(window->data, &window->data[bheight * width * CHANNELS],
+				(rheight - bheight) * width * CHANNELS);
+		memset(&window->data[(rheight - bheight) * width * CHANNELS], 0,
+				bheight * width * CHANNELS);
+	}
+	write_window_rows(png, window, bcount * bheight - margins[TOP], rheight - bheight);
+
+	bool ok = close_png_stream(png);
 	printf("Total render time: %f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
 
+	free_image(window);
+	free_image(rimg);
+	free_coverage(cov);
+	free_textures(tex);
 	free_world(world);
 
-	return img;
+	return ok;
 }
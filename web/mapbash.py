@@ -66,23 +66,28 @@ def render_world(config, world):
             'types': [],
             }
 
+    # render all the map types of each dimension in a single pass over its chunks
+    dimensions = {}
     for maptype in world['maptypes']:
-        print('Rendering {} map for {}...'.format(maptype['name'], world['name']))
+        dimension = (bool(maptype['nether'] or maptype['hell']), bool(maptype['end']))
+        dimensions.setdefault(dimension, []).append(maptype)
 
-        mapdir = os.path.join(world['wwwdir'], maptype['dir'])
+    for (nether, end), maptypes in dimensions.items():
+        print('Rendering {} maps for {}...'.format(
+            ', '.join(maptype['name'] for maptype in maptypes), world['name']))
 
         command = [arg for arg in
                    [os.path.join(config['bindir'], 'cmapbash'),
-                    '-d' if maptype['dark'] or maptype['night'] else None,
-                    '-i' if maptype['iso'] else None,
-                    '-n' if maptype['nether'] or maptype['hell'] else None,
-                    '-e' if maptype['end'] else None,
-                    '-b',
-                    # '-o', imgpath,
+                    '-n' if nether else None,
+                    '-e' if end else None,
                     '-w', world['worlddir'],
-                    '-g', mapdir
                     ]
                    if arg]
+        for maptype in maptypes:
+            modes = ''.join(['i' if maptype['iso'] else '',
+                             'd' if maptype['dark'] or maptype['night'] else '',
+                             'b'])
+            command += ['-M', '{}:{}/'.format(modes, os.path.join(world['wwwdir'], maptype['dir']))]
         print(' '.join(command))
 
         proc = subprocess.Popen(command, cwd=config['bindir'],
@@ -93,6 +98,8 @@ def render_world(config, world):
             print('   ' + line.rstrip().decode('utf-8'))
         print('Done rendering.')
 
+    for maptype in world['maptypes']:
+        mapdir = os.path.join(world['wwwdir'], maptype['dir'])
         zlevels = sorted(int(zdir[4:]) for zdir in os.listdir(mapdir) if zdir[:4] == 'zoom')
 
         info['types'].append({